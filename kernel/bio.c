@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -22,34 +22,147 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "slab.h"
+
+// Buffers are kept in a hash table keyed on (dev, blockno), each
+// bucket with its own lock, so that a cache hit only takes the lock
+// of the block's bucket. A miss reuses the least recently released
+// free buffer in that bucket, or, if there is none, takes bcache.lock
+// and either adds a new buffer or steals one from another bucket.
+// Lock order: bcache.lock, then the block's bucket lock, then any
+// other bucket lock. Only a thief holds more than one bucket lock,
+// and bcache.lock makes sure there is one thief at a time.
+#define NBUCKET 13
+
+// The NBUF buffers in bcache.buf are always there. Beyond them the
+// cache grows into free memory, from bufcache, as long as more than
+// BUFLOWMEM pages stay free; when fewer do, idle harts hand the
+// least recently used extra buffers back (see bshrink), and so
+// does kalloc() when it runs out (see breclaim).
+#define BUFLOWMEM 2048  // 8 MB
+#define BRECLAIM 8      // extra buffers breclaim() frees at most
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;   // chain through buf.next
+  uint64 nhit;        // bget()s that found the block here
+  uint64 nmiss;       // bget()s that had to read it
+};
 
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
-
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct bucket bucket[NBUCKET];
+  int nbuf;           // buffers, including those in buf[]
+  int nwait;          // bget()s looking or waiting for a buffer
 } bcache;
 
+struct kmem_cache bufcache;
+
+static void bput(struct buf *b);
+
+static void
+bufctor(void *p)
+{
+  initsleeplock(&((struct buf*)p)->lock, "buffer");
+}
+
+static struct bucket *
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Is b one of the extra buffers from bufcache?
+static int
+bextra(struct buf *b)
+{
+  return b < bcache.buf || b >= bcache.buf+NBUF;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  kmem_cache_init(&bufcache, "buf", sizeof(struct buf), bufctor);
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // Spread the buffers over the buckets; each says it holds
+  // block i of no device, which nobody will ask for.
+  for(i = 0, b = bcache.buf; b < bcache.buf+NBUF; b++, i++){
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->blockno = i;
+    bk = &bcache.bucket[i % NBUCKET];
+    b->next = bk->head;
+    bk->head = b;
+  }
+  bcache.nbuf = NBUF;
+}
+
+// Return bk's cached copy of the block, or 0.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Return bk's least recently released unused buffer, or 0.
+// Only extra buffers count if extra is set.
+// Caller must hold bk->lock.
+static struct buf*
+blru(struct bucket *bk, int extra)
+{
+  struct buf *b, *lru = 0;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->refcnt == 0 && (!extra || bextra(b)) &&
+       (lru == 0 || b->lastuse < lru->lastuse))
+      lru = b;
+  return lru;
+}
+
+// Take the least recently released unused buffer out of any
+// bucket other than skip (which may be 0), or 0 if there is none.
+// Caller must hold bcache.lock, and skip->lock if skip is set.
+static struct buf*
+btake(struct bucket *skip, int extra)
+{
+  struct bucket *o, *best = 0;
+  struct buf *b, *lru = 0, **pp;
+
+  for(o = bcache.bucket; o < bcache.bucket+NBUCKET; o++){
+    if(o == skip)
+      continue;
+    acquire(&o->lock);
+    b = blru(o, extra);
+    if(b && (lru == 0 || b->lastuse < lru->lastuse)){
+      if(best)
+        release(&best->lock);
+      best = o;
+      lru = b;
+    } else {
+      release(&o->lock);
+    }
   }
+  if(lru == 0)
+    return 0;
+
+  for(pp = &best->head; *pp != lru; pp = &(*pp)->next)
+    ;
+  *pp = lru->next;
+  release(&best->lock);
+  return lru;
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,34 +171,133 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b, *nb;
+  int hit;
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bfind(bk, dev, blockno)) != 0){
+    bk->nhit++;
+    goto found;
   }
+  bk->nmiss++;
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Recycle the least recently used (LRU) unused buffer,
+  // from this bucket if it has one.
+  if((b = blru(bk, 0)) != 0)
+    goto recycle;
+  release(&bk->lock);
+
+  // Add a buffer while memory is plentiful, else steal one,
+  // else wait for one to be released. Another process may
+  // cache the block while bk->lock is let go.
+  // Our own queued disk requests may be what holds the buffers,
+  // so send them first.
+  bkick();
+  nb = 0;
+  if(kfreepages() > BUFLOWMEM)
+    nb = kmem_cache_alloc(&bufcache);
+  hit = 0;
+  acquire(&bcache.lock);
+  // Count ourselves as waiting before looking, so that a bput()
+  // of a bucket already searched does not miss waking us.
+  bcache.nwait++;
+  __sync_synchronize();
+  for(;;){
+    acquire(&bk->lock);
+    if((b = bfind(bk, dev, blockno)) != 0){
+      hit = 1;
+      break;
+    }
+    if((b = nb) != 0){
+      nb = 0;
+      b->refcnt = 0;
+      b->disk = 0;
+      b->done = 0;
+      bcache.nbuf++;
+    } else if((b = blru(bk, 0)) != 0){
+      break;
+    } else if((b = btake(bk, 0)) == 0){
+      release(&bk->lock);
+      sleep(&bcache, &bcache.lock);
+      continue;
     }
+    b->next = bk->head;
+    bk->head = b;
+    break;
   }
-  panic("bget: no buffers");
+  bcache.nwait--;
+  release(&bcache.lock);
+  if(nb)
+    kmem_cache_free(&bufcache, nb);
+  if(hit)
+    goto found;
+
+recycle:
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+found:
+  b->refcnt++;
+  release(&bk->lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Free the least recently used unused extra buffer, straight
+// back to its slab so that the memory can be reused at once.
+// Returns 1 if there was one.
+static int
+bfreeextra(void)
+{
+  struct buf *b;
+
+  if(__atomic_load_n(&bcache.nbuf, __ATOMIC_RELAXED) <= NBUF)
+    return 0;
+  acquire(&bcache.lock);
+  if((b = btake(0, 1)) != 0)
+    bcache.nbuf--;
+  release(&bcache.lock);
+  if(b == 0)
+    return 0;
+  kmem_cache_release(&bufcache, b);
+  return 1;
+}
+
+// Give the least recently used extra buffer back to the
+// allocator if memory is short. Called by the scheduler when
+// it has nothing to run. Returns 1 if it freed a buffer.
+int
+bshrink(void)
+{
+  if(kfreepages() >= BUFLOWMEM)
+    return 0;
+  return bfreeextra();
+}
+
+// Free up to BRECLAIM extra buffers for kalloc(), which has
+// run out of memory, unless the caller holds one of the locks
+// that would take. Returns the number freed.
+int
+breclaim(void)
+{
+  struct bucket *bk;
+  int n, busy;
+
+  push_off();
+  busy = holding(&bcache.lock) || holding(&bufcache.lock);
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    busy |= holding(&bk->lock);
+  pop_off();
+  if(busy)
+    return 0;
+
+  for(n = 0; n < BRECLAIM && bfreeextra(); n++)
+    ;
+  return n;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +314,43 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Start reading the indicated block into the cache without
+// waiting for the disk, unless it is cached already. The buffer
+// stays locked, and referenced, until bdone(). Like the other
+// asynchronous requests, the read is only sent to the disk by
+// bkick() or the next request that is waited for.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    return;
+
+  b = bget(dev, blockno);
+  if(b->valid){
+    brelse(b);
+    return;
+  }
+  b->done = bdone;
+  virtio_disk_start(b, 0);
+}
+
+// Finish a read started by breadahead().
+// Called from the disk interrupt.
+void
+bdone(struct buf *b)
+{
+  b->done = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,8 +360,57 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Drop a reference to b. If it was the last, stamp b with
+// the time, for LRU, and wake anyone waiting for a buffer.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = bhash(b->dev, b->blockno);
+  int free;
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  if((free = (b->refcnt == 0)))
+    b->lastuse = ticks;
+  release(&bk->lock);
+
+  // Pairs with the fence in bget(): either bget() sees the
+  // free buffer when it looks, or we see that it is waiting.
+  __sync_synchronize();
+  if(free && __atomic_load_n(&bcache.nwait, __ATOMIC_RELAXED) > 0){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
+  }
+}
+
+// Start writing b's contents to disk, to be waited for with
+// bwait(), so that a caller can have several writes in flight.
+// Must be locked, and stay locked until bwait().
+void
+bwrite_start(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_start");
+  virtio_disk_start(b, 1);
+}
+
+// Wait for the write bwrite_start() began on b.
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
+// Send the disk the requests queued by breadahead() and
+// bwrite_start().
+void
+bkick(void)
+{
+  virtio_disk_kick();
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +418,36 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  bput(b);
 }
 
+// Print buffer cache statistics. For debugging.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+bcachedump(void)
+{
+  struct bucket *bk;
+  uint64 nhit = 0, nmiss = 0;
 
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    nhit += bk->nhit;
+    nmiss += bk->nmiss;
+  }
+  printf("bcache: buffers %d hits %d misses %d\n",
+         bcache.nbuf, (int)nhit, (int)nmiss);
+}
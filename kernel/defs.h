@@ -1,13 +1,18 @@
 struct buf;
 struct context;
 struct file;
+struct files;
 struct inode;
+struct kmem_cache;
+struct mm;
 struct pipe;
 struct proc;
+struct rastate;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 typedef int thread_t;
 
@@ -24,6 +29,22 @@ void bpin(struct buf *);
 
 void bunpin(struct buf *);
 
+void breadahead(uint, uint);
+
+void bwrite_start(struct buf *);
+
+void bwait(struct buf *);
+
+void bkick(void);
+
+void bdone(struct buf *);
+
+int bshrink(void);
+
+int breclaim(void);
+
+void bcachedump(void);
+
 // console.c
 void consoleinit(void);
 
@@ -32,7 +53,7 @@ void consoleintr(int);
 void consputc(int);
 
 // exec.c
-int exec(char *, char **);
+int exec(struct proc *, char *, char **);
 
 // file.c
 struct file *filealloc(void);
@@ -41,6 +62,12 @@ void fileclose(struct file *);
 
 struct file *filedup(struct file *);
 
+struct files *filesalloc(void);
+
+struct files *filesdup(struct files *);
+
+void filesput(struct files *);
+
 void fileinit(void);
 
 int fileread(struct file *, uint64, int n);
@@ -49,6 +76,13 @@ int filestat(struct file *, uint64 addr);
 
 int filewrite(struct file *, uint64, int n);
 
+// futex.c
+void futexinit(void);
+
+int futex_wait(uint64, int);
+
+int futex_wake(uint64, int);
+
 // fs.c
 void fsinit(int);
 
@@ -80,6 +114,8 @@ struct inode *nameiparent(char *, char *);
 
 int readi(struct inode *, int, uint64, uint, uint);
 
+int readira(struct inode *, struct rastate *, int, uint64, uint, uint);
+
 void stati(struct inode *, struct stat *);
 
 int writei(struct inode *, int, uint64, uint, uint);
@@ -100,6 +136,41 @@ void kfree(void *);
 
 void kinit(void);
 
+void kallocdump(void);
+
+void *kalloc_zeroed(void);
+
+int kzero_refill(void);
+
+void *kalloc_order(int);
+
+void kfree_order(void *, int);
+
+void ksplit(void *, int);
+
+void krefinc(void *);
+
+int krefcnt(void *);
+
+uint64 kfreepages(void);
+
+// slab.c
+void kmallocinit(void);
+
+void kmem_cache_init(struct kmem_cache *, char *, uint, void (*)(void *));
+
+void *kmem_cache_alloc(struct kmem_cache *);
+
+void kmem_cache_free(struct kmem_cache *, void *);
+
+void kmem_cache_release(struct kmem_cache *, void *);
+
+void *kmalloc(uint);
+
+void kmfree(void *);
+
+void kmemdump(void);
+
 // log.c
 void initlog(int, struct superblock *);
 
@@ -112,6 +183,8 @@ void end_op(void);
 // pipe.c
 int pipealloc(struct file **, struct file **);
 
+void pipeinit(void);
+
 void pipeclose(struct pipe *, int);
 
 int piperead(struct pipe *, uint64, int);
@@ -132,13 +205,21 @@ void exit(int);
 
 int fork(void);
 
+int spawn(char *, char **, int *);
+
 int growproc(int);
 
+int pagefault(pagetable_t, uint64, int);
+
+void tlbshootdown(pagetable_t);
+
 void proc_mapstacks(pagetable_t);
 
-pagetable_t proc_pagetable(struct proc *);
+struct mm *proc_mm(struct proc *);
+
+void proc_freemm(struct proc *, struct mm *);
 
-void proc_freepagetable(struct proc *, pagetable_t, uint64);
+void proc_setmm(struct proc *, struct mm *);
 
 int kill(int);
 
@@ -166,6 +247,8 @@ int wait(uint64);
 
 void wakeup(void *);
 
+int wakeup_one(void *);
+
 void yield(void);
 
 int either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
@@ -177,12 +260,15 @@ void procdump(void);
 ////// Assignment 6 : Thread //////
 int tfork(void *(*func)(void *), void *arg);
 
-int twait(thread_t t, void **ret);
+int twait(thread_t t, uint64 ret);
 
-void texit(void *ret);
+void texit(uint64 ret);
 ///////////////////////////////////
 
 
+// start.c
+int timertick(void);
+
 // swtch.S
 void swtch(struct context *, struct context *);
 
@@ -199,6 +285,8 @@ void push_off(void);
 
 void pop_off(void);
 
+int cansleep(void);
+
 // sleeplock.c
 void acquiresleep(struct sleeplock *);
 
@@ -208,6 +296,9 @@ int holdingsleep(struct sleeplock *);
 
 void initsleeplock(struct sleeplock *, char *);
 
+// membench.c
+void membench(void);
+
 // string.c
 int memcmp(const void *, const void *, uint);
 
@@ -274,7 +365,23 @@ void uvmfirst(pagetable_t, uchar *, uint);
 uint64 uvmalloc(pagetable_t, uint64, uint64, int);
 
 uint64 uvmdealloc(pagetable_t, uint64, uint64);
-int uvmcopy(pagetable_t, pagetable_t, uint64);
+int uvmcopy(pagetable_t, pagetable_t, uint64, uint64);
+
+int uvmcow(pagetable_t, uint64);
+
+int uvmmapped(pagetable_t, uint64);
+
+int uvmzero(pagetable_t, uint64);
+
+uint64 uvmresident(pagetable_t);
+
+int uvmcanmega(pagetable_t, uint64);
+
+char *uvmallocmega(void);
+
+int uvmmapmega(pagetable_t, uint64, char *, int);
+
+int uvmsplit(pagetable_t, uint64);
 void uvmfree(pagetable_t, uint64);
 
 void uvmunmap(pagetable_t, uint64, uint64, int);
@@ -285,12 +392,47 @@ pte_t *walk(pagetable_t, uint64, int);
 
 uint64 walkaddr(pagetable_t, uint64);
 
+uint64 walkuaddr(pagetable_t, uint64, int);
+
+int uvmprefault(pagetable_t, uint64, uint64, int);
+
 int copyout(pagetable_t, uint64, char *, uint64);
 
 int copyin(pagetable_t, char *, uint64, uint64);
 
 int copyinstr(pagetable_t, char *, uint64, uint64);
 
+// vma.c
+void vmainit(void);
+
+int vma_add(struct mm *, uint64, uint64, int, struct inode *, uint, uint);
+
+struct vma *vma_find(struct mm *, uint64);
+
+int vma_overlaps(struct mm *, uint64, uint64);
+
+uint64 vma_mmap(struct mm *, uint64, int, int, struct inode *, uint);
+
+int vma_munmap(struct mm *, uint64, uint64);
+
+int vma_dup(struct mm *, struct vma *);
+
+void vma_freelist(struct vma *);
+
+void vma_reap(void);
+
+int vma_fault(struct mm *, struct vma *, uint64);
+
+void pcache_update(struct inode *, uint, char *, uint);
+
+void pcache_truncate(struct inode *);
+
+void pcache_drop(struct inode *);
+
+void pcache_hold(struct inode *);
+
+void pcache_unhold(struct inode *);
+
 // plic.c
 void plicinit(void);
 
@@ -305,6 +447,12 @@ void virtio_disk_init(void);
 
 void virtio_disk_rw(struct buf *, int);
 
+void virtio_disk_start(struct buf *, int);
+
+void virtio_disk_kick(void);
+
+void virtio_disk_wait(struct buf *);
+
 void virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -4,11 +4,12 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags) {
 	int perm = 0;
 	if (flags & 0x1)
@@ -18,17 +19,20 @@ int flags2perm(int flags) {
 	return perm;
 }
 
+// Replace the user image of process p, which is either the
+// caller or, for spawn(), a new process that is not running yet.
 int
-exec(char *path, char **argv) {
+exec(struct proc *p, char *path, char **argv) {
 	char *s, *last;
 	int i, off;
 	uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
 	struct elfhdr elf;
 	struct inode *ip;
 	struct proghdr ph;
-	pagetable_t pagetable = 0, oldpagetable;
-	struct proc *p = myproc();
+	pagetable_t pagetable = 0;
+	struct mm *mm = 0;
 
+	vma_reap();
 	begin_op();
 
 	if ((ip = namei(path)) == 0) {
@@ -44,10 +48,12 @@ exec(char *path, char **argv) {
 	if (elf.magic != ELF_MAGIC)
 		goto bad;
 
-	if ((pagetable = proc_pagetable(p)) == 0)
+	if ((mm = proc_mm(p)) == 0)
 		goto bad;
+	pagetable = mm->pagetable;
 
-	// Load program into memory.
+	// Map the program. Its pages are read in when they are
+	// first touched; see vma_fault().
 	for (i = 0, off = elf.phoff; i < elf.phnum; i++, off += sizeof(ph)) {
 		if (readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
 			goto bad;
@@ -59,33 +65,32 @@ exec(char *path, char **argv) {
 			goto bad;
 		if (ph.vaddr % PGSIZE != 0)
 			goto bad;
-		uint64 sz1;
-		if ((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+		if (ph.vaddr < sz || ph.vaddr + ph.memsz > TSTACKBASE)
+			goto bad;
+		if (ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
 			goto bad;
-		sz = sz1;
-		if (loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+		if (vma_add(mm, ph.vaddr, ph.vaddr + ph.memsz,
+					flags2perm(ph.flags) | PTE_R | PTE_U,
+					ip, ph.off, ph.filesz) < 0)
 			goto bad;
+		sz = PGROUNDUP(ph.vaddr + ph.memsz);
 	}
+	pcache_hold(ip);
 	iunlockput(ip);
 	end_op();
 	ip = 0;
 
-	p = myproc();
-	uint64 oldsz = *(p->sz);
-
-	// Allocate NPROC+1 pages at the next page boundary.
+	// Allocate two pages at the next page boundary.
+	// Make the first inaccessible as a stack guard.
+	// Use the second as the user stack.
+	// Other threads get their own stacks from tfork().
 	sz = PGROUNDUP(sz);
 	uint64 sz1;
-	if ((sz1 = uvmalloc(pagetable, sz, sz + (NPROC + 1) * PGSIZE, PTE_W)) == 0)
+	if ((sz1 = uvmalloc(pagetable, sz, sz + 2 * PGSIZE, PTE_W)) == 0)
 		goto bad;
 	sz = sz1;
-	// The first page is a guard page.
-	uvmclear(pagetable, sz - (NPROC + 1) * PGSIZE);
-	// The next NPROC pages are aligned with the relative position of procs in
-	// the proc[NPROC] array. (p-proc) tells where the proc is located in the
-	// proc[] array. The stack pointer (sp) points to the top of the stack that
-	// grows downward, not the base address of the page.
-	sp = sz - (NPROC - 1 - (p - proc)) * PGSIZE;
+	uvmclear(pagetable, sz - 2 * PGSIZE);
+	sp = sz;
 	stackbase = sp - PGSIZE;
 
 	// Push argument strings, prepare rest of stack in ustack.
@@ -122,45 +127,23 @@ exec(char *path, char **argv) {
 	safestrcpy(p->name, last, sizeof(p->name));
 
 	// Commit to the user image.
-	oldpagetable = p->pagetable;
-	p->pagetable = pagetable;
-	*(p->sz) = sz;
+	// Any other threads keep the old address space alive until
+	// they are gone.
+	mm->sz = sz;
+	proc_setmm(p, mm);
 	p->trapframe->epc = elf.entry;  // initial program counter = main
 	p->trapframe->sp = sp; // initial stack pointer
-	proc_freepagetable(p, oldpagetable, oldsz);
 
 	return argc; // this ends up in a0, the first argument to main(argc, argv)
 
 	bad:
-	if (pagetable)
-		proc_freepagetable(p, pagetable, sz);
 	if (ip) {
 		iunlockput(ip);
 		end_op();
 	}
-	return -1;
-}
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz) {
-	uint i, n;
-	uint64 pa;
-
-	for (i = 0; i < sz; i += PGSIZE) {
-		pa = walkaddr(pagetable, va + i);
-		if (pa == 0)
-			panic("loadseg: address should exist");
-		if (sz - i < PGSIZE)
-			n = sz - i;
-		else
-			n = PGSIZE;
-		if (readi(ip, 0, (uint64)pa, offset + i, n) != n)
-			return -1;
+	if (mm) {
+		mm->sz = sz;
+		proc_freemm(p, mm);
 	}
-
-	return 0;
+	return -1;
 }
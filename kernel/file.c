@@ -12,17 +12,21 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache filecache;
+  struct kmem_cache filescache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kmem_cache_init(&ftable.filecache, "file", sizeof(struct file), 0);
+  kmem_cache_init(&ftable.filescache, "files", sizeof(struct files), 0);
 }
 
 // Allocate a file structure.
@@ -31,16 +35,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(&ftable.filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +68,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(&ftable.filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -82,6 +80,60 @@ fileclose(struct file *f)
   }
 }
 
+// Allocate an empty file descriptor table.
+struct files*
+filesalloc(void)
+{
+  struct files *fs;
+
+  if((fs = kmem_cache_alloc(&ftable.filescache)) == 0)
+    return 0;
+  memset(fs, 0, sizeof(*fs));
+  fs->ref = 1;
+  return fs;
+}
+
+// Increment ref count for file descriptor table fs.
+struct files*
+filesdup(struct files *fs)
+{
+  acquire(&ftable.lock);
+  if(fs->ref < 1)
+    panic("filesdup");
+  fs->ref++;
+  release(&ftable.lock);
+  return fs;
+}
+
+// Drop a reference to file descriptor table fs; the last
+// one closes its files and releases the current directory.
+void
+filesput(struct files *fs)
+{
+  struct files ff;
+
+  acquire(&ftable.lock);
+  if(fs->ref < 1)
+    panic("filesput");
+  if(--fs->ref > 0){
+    release(&ftable.lock);
+    return;
+  }
+  ff = *fs;
+  release(&ftable.lock);
+  kmem_cache_free(&ftable.filescache, fs);
+
+  for(int fd = 0; fd < NOFILE; fd++){
+    if(ff.ofile[fd])
+      fileclose(ff.ofile[fd]);
+  }
+  if(ff.cwd){
+    begin_op();
+    iput(ff.cwd);
+    end_op();
+  }
+}
+
 // Get metadata about file f.
 // addr is a user virtual address, pointing to a struct stat.
 int
@@ -94,7 +146,7 @@ filestat(struct file *f, uint64 addr)
     ilock(f->ip);
     stati(f->ip, &st);
     iunlock(f->ip);
-    if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    if(copyout(p->mm->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
   }
@@ -107,6 +159,7 @@ int
 fileread(struct file *f, uint64 addr, int n)
 {
   int r = 0;
+  uint m;
 
   if(f->readable == 0)
     return -1;
@@ -119,7 +172,20 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if((r = readira(f->ip, &f->ra, 1, addr, f->off, n)) < 0 && f->off < f->ip->size){
+      // addr may be in pages mapped from a file, which cannot
+      // be read in while we hold an inode's lock (see canread()
+      // in vma.c). Fault them in and try again.
+      m = f->ip->size - f->off;
+      if(m > n)
+        m = n;
+      iunlock(f->ip);
+      if(uvmprefault(myproc()->mm->pagetable, addr, m, 1) < 0)
+        return -1;
+      ilock(f->ip);
+      r = readira(f->ip, &f->ra, 1, addr, f->off, n);
+    }
+    if(r > 0)
       f->off += r;
     iunlock(f->ip);
   } else {
@@ -153,7 +219,7 @@ filewrite(struct file *f, uint64 addr, int n)
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
+    int i = 0, retried = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
@@ -167,9 +233,16 @@ filewrite(struct file *f, uint64 addr, int n)
       end_op();
 
       if(r != n1){
-        // error from writei
-        break;
-      }
+        // error from writei, or the source is in pages mapped
+        // from a file, which cannot be read in while we hold an
+        // inode's lock (see canread() in vma.c). Fault them in
+        // and try the rest again.
+        if(r < 0 || retried ||
+           uvmprefault(myproc()->mm->pagetable, addr + i + r, n1 - r, 0) < 0)
+          break;
+        retried = 1;
+      } else
+        retried = 0;
       i += r;
     }
     ret = (i == n ? n : -1);
@@ -1,3 +1,11 @@
+// where a file is being read in order, and how far ahead
+// of the reader; see readahead() in fs.c.
+struct rastate {
+  uint next;         // block a sequential read reads next
+  uint end;          // blocks before this have been read ahead
+  uint win;          // readahead window, in blocks
+};
+
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
   int ref; // reference count
@@ -6,6 +14,7 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  struct rastate ra; // FD_INODE
   short major;       // FD_DEVICE
 };
 
@@ -27,6 +36,8 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  struct pcpage *pages; // page cache; see vma.c
 };
 
 // map major device number to device functions.
@@ -22,6 +22,13 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Sequential reads of a file read ahead a window of blocks, which
+// starts at RAMIN blocks and doubles up to RAMAX while reads stay in
+// order. RAMAX is also the most blocks one readi() starts at once.
+#define RAMIN 4
+#define RAMAX 64
+
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb;
@@ -289,6 +296,7 @@ ilock(struct inode *ip) {
 		panic("ilock");
 
 	acquiresleep(&ip->lock);
+	myproc()->nilock++;
 
 	if (ip->valid == 0) {
 		bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -312,6 +320,7 @@ iunlock(struct inode *ip) {
 	if (ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
 		panic("iunlock");
 
+	myproc()->nilock--;
 	releasesleep(&ip->lock);
 }
 
@@ -345,6 +354,8 @@ iput(struct inode *ip) {
 		acquire(&itable.lock);
 	}
 
+	if (ip->ref == 1)
+		pcache_drop(ip);
 	ip->ref--;
 	release(&itable.lock);
 }
@@ -406,6 +417,73 @@ bmap(struct inode *ip, uint bn) {
 	panic("bmap: out of range");
 }
 
+// The disk address of block bn in inode ip, like bmap(), but 0
+// rather than a new block if there is none.
+static uint
+bmapped(struct inode *ip, uint bn) {
+	uint addr;
+	struct buf *bp;
+
+	if (bn < NDIRECT)
+		return ip->addrs[bn];
+	bn -= NDIRECT;
+
+	if (bn >= NINDIRECT || (addr = ip->addrs[NDIRECT]) == 0)
+		return 0;
+	bp = bread(ip->dev, addr);
+	addr = ((uint *)bp->data)[bn];
+	brelse(bp);
+	return addr;
+}
+
+// Start reading blocks from up to end of ip into the cache,
+// stopping at the end of the file. The disk gets runs of
+// consecutive blocks as single requests.
+// Caller must hold ip->lock.
+static void
+readblocks(struct inode *ip, uint from, uint end) {
+	uint b, addr;
+
+	end = min(end, (ip->size + BSIZE - 1) / BSIZE);
+	for (b = from; b < end; b++) {
+		if ((addr = bmapped(ip, b)) == 0)
+			break;
+		breadahead(ip->dev, addr);
+	}
+	bkick();
+}
+
+// Note that block bn of ip has been read through a file whose
+// readahead state is ra, and if the file is being read in order
+// start reading the blocks that come next, so that they are cached
+// by the time readi() gets to them. The state is kept per open
+// file, not per inode, so that readers of the same inode at
+// different places do not keep resetting each other's window.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, struct rastate *ra, uint bn) {
+	uint end;
+
+	if (bn + 1 == ra->next)   // more of the same block
+		return;
+	if (bn == ra->next) {
+		ra->win = ra->win ? min(2 * ra->win, RAMAX) : RAMIN;
+	} else {
+		// A seek; start over.
+		ra->win = 0;
+		ra->end = 0;
+	}
+	ra->next = bn + 1;
+
+	// Wait until half the window has been used, then read the
+	// rest of it in one go, so that the requests are large.
+	if (ra->end >= bn + 1 + ra->win / 2)
+		return;
+	end = bn + 1 + ra->win;
+	readblocks(ip, ra->end > bn + 1 ? ra->end : bn + 1, end);
+	ra->end = end;
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -414,6 +492,8 @@ itrunc(struct inode *ip) {
 	struct buf *bp;
 	uint *a;
 
+	pcache_truncate(ip);
+
 	for (i = 0; i < NDIRECT; i++) {
 		if (ip->addrs[i]) {
 			bfree(ip->dev, ip->addrs[i]);
@@ -454,6 +534,13 @@ stati(struct inode *ip, struct stat *st) {
 // otherwise, dst is a kernel address.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
+	return readira(ip, 0, user_dst, dst, off, n);
+}
+
+// Like readi(), for a read through an open file whose readahead
+// state is ra.
+int
+readira(struct inode *ip, struct rastate *ra, int user_dst, uint64 dst, uint off, uint n) {
 	uint tot, m;
 	struct buf *bp;
 
@@ -462,6 +549,10 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
 	if (off + n > ip->size)
 		n = ip->size - off;
 
+	// Start on all the blocks a large read needs at once.
+	if (n > 0 && off / BSIZE != (off + n - 1) / BSIZE)
+		readblocks(ip, off / BSIZE, min((off + n - 1) / BSIZE + 1, off / BSIZE + RAMAX));
+
 	for (tot = 0; tot < n; tot += m, off += m, dst += m) {
 		uint addr = bmap(ip, off / BSIZE);
 		if (addr == 0)
@@ -474,6 +565,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
 			break;
 		}
 		brelse(bp);
+		if (ra)
+			readahead(ip, ra, off / BSIZE);
 	}
 	return tot;
 }
@@ -505,6 +598,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
 			brelse(bp);
 			break;
 		}
+		// mappings of ip see the new data too.
+		pcache_update(ip, off, user_src ? (char *)bp->data + (off % BSIZE) : (char *)src, m);
 		log_write(bp);
 		brelse(bp);
 	}
@@ -633,7 +728,7 @@ namex(char *path, int nameiparent, char *name) {
 	if (*path == '/')
 		ip = iget(ROOTDEV, ROOTINO);
 	else
-		ip = idup((*(myproc()->cwd)));
+		ip = idup(myproc()->files->cwd);
 
 	while ((path = skipelem(path, name)) != 0) {
 		ilock(ip);
@@ -0,0 +1,97 @@
+//
+// Futexes: let user threads block on a word of user memory.
+//
+// A futex is named by the physical address of the word, so
+// threads that share a page table (see tfork()) rendezvous no
+// matter which virtual address they use. futex_wait() goes to
+// sleep only if the word still holds the value the caller
+// expects; futex_wake() takes the same lock, so a wakeup issued
+// after the word changes cannot slip in between the check and
+// the sleep.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define NFUTEX 16
+
+struct spinlock futex_lock[NFUTEX];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futex_lock[i], "futex");
+}
+
+static struct spinlock *
+futexlock(uint64 pa)
+{
+  return &futex_lock[(pa / sizeof(uint32)) % NFUTEX];
+}
+
+// Translate the user address of a futex word to a physical
+// address, or return 0 if addr is misaligned or unmapped.
+static uint64
+futexaddr(uint64 addr)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+
+  if(addr % sizeof(uint32) != 0)
+    return 0;
+  // Key by the page a store would go to, so that a futex shared
+  // copy-on-write after fork is split first.
+  if((pa = walkuaddr(p->mm->pagetable, PGROUNDDOWN(addr), 1)) == 0)
+    return 0;
+  return pa + (addr - PGROUNDDOWN(addr));
+}
+
+// Sleep until futex_wake() on addr, provided the word at addr
+// still holds val. Returns 0 after a wakeup, -1 if the word
+// had already changed or addr is bad.
+int
+futex_wait(uint64 addr, int val)
+{
+  struct spinlock *lk;
+  uint64 pa;
+
+  if((pa = futexaddr(addr)) == 0)
+    return -1;
+
+  lk = futexlock(pa);
+  acquire(lk);
+  if(*(volatile int*)pa != val || killed(myproc())){
+    release(lk);
+    return -1;
+  }
+  sleep((void*)pa, lk);
+  release(lk);
+  return 0;
+}
+
+// Wake up to n threads waiting on addr.
+// Returns the number woken, or -1 if addr is bad.
+int
+futex_wake(uint64 addr, int n)
+{
+  struct spinlock *lk;
+  uint64 pa;
+  int woken;
+
+  if((pa = futexaddr(addr)) == 0)
+    return -1;
+
+  lk = futexlock(pa);
+  acquire(lk);
+  for(woken = 0; woken < n; woken++){
+    if(wakeup_one((void*)pa) == 0)
+      break;
+  }
+  release(lk);
+  return woken;
+}
@@ -1,6 +1,8 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or with kalloc_order(), naturally aligned blocks of
+// 2^n contiguous pages from a buddy allocator.
 
 #include "types.h"
 #include "param.h"
@@ -11,22 +13,70 @@
 
 void freerange(void *pa_start, void *pa_end);
 
+static void bfree(void *pa, int order);
+
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
 struct run {
   struct run *next;
+  struct run *prev; // buddy free lists only
 };
 
+// Free memory is kept in buddy free lists: a free block of order k
+// is 2^k pages aligned to its size, and when both halves of a block
+// are free they are merged. kstate[] records, for the first page of
+// each free block, KFREE and its order.
+#define MAXORDER 10 // largest block is 2^MAXORDER pages
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define KFREE 0x80
+
+// Each cpu keeps a small cache ("magazine") of free pages, so that
+// most kalloc()/kfree() calls touch only that cpu's lock. Pages
+// move between a cache and the buddy lists KBATCH at a time.
+// Cached pages count as allocated as far as the buddy lists go.
+#define KCACHE 64   // most pages a cpu caches before draining
+#define KBATCH 16   // pages moved to or from the buddy lists at once
+
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *freelist[MAXORDER+1];
+  uchar kstate[NPAGE];
+  uint64 nfree;     // pages in the buddy lists
+  uint64 nlock;     // global lock acquisitions by kalloc/kfree
 } kmem;
 
+// References to each allocated page (or to the first page of a
+// kalloc_order() block), so that copy-on-write fork can share
+// pages. kalloc() hands out a page with one reference and
+// kfree() only frees it when the last one goes. Updated with
+// atomics rather than under a lock.
+int kref[NPAGE];
+
+// Each cpu also keeps a pool of pages that are already zero, for
+// kalloc_zeroed(). Idle harts keep the pools topped up (see
+// kzero_refill), so that zeroing happens off the fork/sbrk path.
+#define KZERO 16    // zeroed pages per cpu
+
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+  struct run *zlist; // zeroed pages
+  int nz;
+  uint64 nhit;      // kalloc()s served from this cache
+  uint64 nmiss;     // kalloc()s that had to refill it
+  uint64 nsteal;    // refills taken from another cpu's cache
+  uint64 nzhit;     // kalloc_zeroed()s served from the zeroed pool
+  uint64 nzmiss;    // kalloc_zeroed()s that zeroed a page themselves
+} kcache[NCPU];
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcache[i].lock, "kcache");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,8 +85,186 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&kmem.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    bfree(p, 0);
+  release(&kmem.lock);
+}
+
+static int
+pgindex(void *pa);
+
+// Add a reference to the allocated page at pa.
+void
+krefinc(void *pa)
+{
+  if(__atomic_fetch_add(&kref[pgindex(pa)], 1, __ATOMIC_RELAXED) < 1)
+    panic("krefinc");
+}
+
+// How many references are there to the allocated page at pa?
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kref[pgindex(pa)], __ATOMIC_RELAXED);
+}
+
+// Drop a reference to the allocated page at pa.
+// Returns the number remaining.
+static int
+krefdec(void *pa)
+{
+  int n = __atomic_sub_fetch(&kref[pgindex(pa)], 1, __ATOMIC_ACQ_REL);
+
+  if(n < 0)
+    panic("kfree: not allocated");
+  return n;
+}
+
+static int
+pgindex(void *pa)
+{
+  return ((uint64)pa - KERNBASE) / PGSIZE;
+}
+
+static void *
+pgaddr(int i)
+{
+  return (void*)(KERNBASE + (uint64)i * PGSIZE);
+}
+
+static void
+bpush(struct run *r, int order)
+{
+  r->prev = 0;
+  r->next = kmem.freelist[order];
+  if(r->next)
+    r->next->prev = r;
+  kmem.freelist[order] = r;
+  kmem.kstate[pgindex(r)] = KFREE | order;
+  kmem.nfree += 1 << order;
+}
+
+static void
+bunlink(struct run *r, int order)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.freelist[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kmem.kstate[pgindex(r)] = 0;
+  kmem.nfree -= 1 << order;
+}
+
+// Return the block of 2^order pages at pa to the buddy lists,
+// merging it with its buddy for as long as that is free too.
+// Caller must hold kmem.lock.
+static void
+bfree(void *pa, int order)
+{
+  int i = pgindex(pa);
+  int b;
+
+  while(order < MAXORDER){
+    b = i ^ (1 << order);
+    if(b >= NPAGE || kmem.kstate[b] != (KFREE | order))
+      break;
+    bunlink((struct run*)pgaddr(b), order);
+    if(b < i)
+      i = b;
+    order++;
+  }
+  bpush((struct run*)pgaddr(i), order);
+}
+
+// Take a block of 2^order pages from the buddy lists, splitting
+// a larger block if need be. Returns 0 if there is none.
+// Caller must hold kmem.lock.
+static void *
+balloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++){
+    if(kmem.freelist[k])
+      break;
+  }
+  if(k > MAXORDER)
+    return 0;
+  r = kmem.freelist[k];
+  bunlink(r, k);
+
+  // Give back the upper halves we don't need.
+  while(k > order){
+    k--;
+    bpush((struct run*)((char*)r + ((uint64)PGSIZE << k)), k);
+  }
+  return (void*)r;
+}
+
+// Move up to n pages from the front of list *from to list *to.
+// Returns the number moved.
+static int
+kmove(struct run **from, struct run **to, int n)
+{
+  struct run *r;
+  int i;
+
+  for(i = 0; i < n && (r = *from) != 0; i++){
+    *from = r->next;
+    r->next = *to;
+    *to = r;
+  }
+  return i;
+}
+
+// Refill cache kc, which is empty, from the global list or
+// else from the fullest other cpu's cache.
+// Caller must hold kc->lock.
+static void
+krefill(struct kcache *kc)
+{
+  struct kcache *victim, *k;
+  struct run *r;
+
+  acquire(&kmem.lock);
+  kmem.nlock++;
+  while(kc->n < KBATCH && (r = balloc(0)) != 0){
+    r->next = kc->freelist;
+    kc->freelist = r;
+    kc->n++;
+  }
+  release(&kmem.lock);
+  if(kc->n > 0)
+    return;
+
+  // Memory is short; take half of another cpu's cache.
+  // Cache locks are only ever held two at a time here, so
+  // order them by address to avoid deadlock.
+  victim = 0;
+  for(k = kcache; k < &kcache[NCPU]; k++){
+    if(k != kc && k->n > 0 && (victim == 0 || k->n > victim->n))
+      victim = k;
+  }
+  if(victim == 0)
+    return;
+  if(victim < kc){
+    release(&kc->lock);
+    acquire(&victim->lock);
+    acquire(&kc->lock);
+  } else {
+    acquire(&victim->lock);
+  }
+  if(kc->n == 0){
+    int n = kmove(&victim->freelist, &kc->freelist, (victim->n + 1) / 2);
+    victim->n -= n;
+    kc->n += n;
+    kc->nsteal++;
+  }
+  release(&victim->lock);
 }
 
 // Free the page of physical memory pointed at by pa,
@@ -47,19 +275,83 @@ void
 kfree(void *pa)
 {
   struct run *r;
+  struct kcache *kc;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  // Still shared?
+  if(krefdec(pa) > 0)
+    return;
+
+#ifdef KALLOC_JUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kcache[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  if(++kc->n > KCACHE){
+    acquire(&kmem.lock);
+    kmem.nlock++;
+    for(int i = 0; i < KBATCH; i++){
+      r = kc->freelist;
+      kc->freelist = r->next;
+      bfree(r, 0);
+    }
+    kc->n -= KBATCH;
+    release(&kmem.lock);
+  }
+  release(&kc->lock);
+  pop_off();
+}
+
+// Take a page from this cpu's cache, or the buddy lists, or
+// another cpu's cache, but not from the zeroed pools.
+// Returns 0 if there is none.
+static struct run *
+kallocpage(void)
+{
+  struct run *r;
+  struct kcache *kc;
+
+  push_off();
+  kc = &kcache[cpuid()];
+  acquire(&kc->lock);
+  if(kc->freelist)
+    kc->nhit++;
+  else {
+    kc->nmiss++;
+    krefill(kc);
+  }
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->n--;
+  }
+  release(&kc->lock);
+  pop_off();
+  return r;
+}
+
+// Take a page from cpu cache kc's zeroed pool, or return 0.
+static struct run *
+kzero_pop(struct kcache *kc)
+{
+  struct run *r;
+
+  acquire(&kc->lock);
+  if((r = kc->zlist) != 0){
+    kc->zlist = r->next;
+    kc->nz--;
+  }
+  release(&kc->lock);
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +361,215 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kcache *kc;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  if((r = kallocpage()) == 0){
+    // Out of memory: shrink the buffer cache, else fall
+    // back on the zeroed pools.
+    if(breclaim() > 0)
+      r = kallocpage();
+    for(kc = kcache; kc < &kcache[NCPU] && r == 0; kc++)
+      r = kzero_pop(kc);
+  }
 
+  if(r)
+    kref[pgindex(r)] = 1;
+#ifdef KALLOC_JUNK
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Allocate one 4096-byte page of zeroed physical memory.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+  struct kcache *kc;
+
+  push_off();
+  kc = &kcache[cpuid()];
+  acquire(&kc->lock);
+  if((r = kc->zlist) != 0){
+    kc->zlist = r->next;
+    kc->nz--;
+    kc->nzhit++;
+  } else
+    kc->nzmiss++;
+  release(&kc->lock);
+  pop_off();
+
+  if(r){
+    memset(r, 0, sizeof(*r)); // the links are the only non-zero words
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
   return (void*)r;
 }
+
+// Give every cpu's cached pages back to the buddy lists, so
+// that they can merge into larger blocks.
+static void
+kdrain(void)
+{
+  struct kcache *kc;
+  struct run *r;
+
+  for(kc = kcache; kc < &kcache[NCPU]; kc++){
+    acquire(&kc->lock);
+    acquire(&kmem.lock);
+    kmem.nlock++;
+    while((r = kc->freelist) != 0){
+      kc->freelist = r->next;
+      bfree(r, 0);
+    }
+    kc->n = 0;
+    release(&kmem.lock);
+    release(&kc->lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Returns 0 if the memory cannot be allocated.
+void *
+kalloc_order(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_order");
+  if(order == 0)
+    return kalloc();
+
+  for(int try = 0; try < 2; try++){
+    acquire(&kmem.lock);
+    kmem.nlock++;
+    pa = balloc(order);
+    release(&kmem.lock);
+    if(pa){
+      kref[pgindex(pa)] = 1;
+#ifdef KALLOC_JUNK
+      memset(pa, 5, (uint64)PGSIZE << order); // fill with junk
+#endif
+      return pa;
+    }
+    // Single pages parked in the cpu caches may be all that
+    // keeps a large enough block from forming.
+    kdrain();
+  }
+  return 0;
+}
+
+// Free 2^order pages allocated by kalloc_order(order).
+void
+kfree_order(void *pa, int order)
+{
+  if(order < 0 || order > MAXORDER)
+    panic("kfree_order");
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa % ((uint64)PGSIZE << order)) != 0 || (char*)pa < end ||
+     (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+
+  if(krefdec(pa) > 0)
+    return;
+
+#ifdef KALLOC_JUNK
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+
+  acquire(&kmem.lock);
+  kmem.nlock++;
+  bfree(pa, order);
+  release(&kmem.lock);
+}
+
+// Turn a block from kalloc_order(order), which must have a
+// single reference, into 2^order pages that are each shared
+// and freed on their own, e.g. the pages of a megapage, so that
+// part of it can be unmapped or copied.
+void
+ksplit(void *pa, int order)
+{
+  int i = pgindex(pa);
+
+  if(kref[i] != 1)
+    panic("ksplit");
+  for(int j = 1; j < (1 << order); j++)
+    kref[i + j] = 1;
+}
+
+// Zero one page for the emptiest cpu's kalloc_zeroed() pool,
+// if any is short; busy cpus use theirs up without refilling.
+// Called by the scheduler when it has nothing to run.
+// Returns 1 if it did some work, 0 if the pools are full or
+// there is no free memory to put in them. Never takes pages
+// from the pools themselves, or an idle hart would go on
+// moving a page out of a pool and back in when memory is out.
+int
+kzero_refill(void)
+{
+  struct kcache *kc, *k;
+  struct run *r;
+
+  kc = 0;
+  for(k = kcache; k < &kcache[NCPU]; k++){
+    if(__atomic_load_n(&k->nz, __ATOMIC_RELAXED) < KZERO &&
+       (kc == 0 || k->nz < kc->nz))
+      kc = k;
+  }
+  if(kc == 0)
+    return 0;
+  if((r = kallocpage()) == 0)
+    return 0;
+  kref[pgindex(r)] = 1;
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&kc->lock);
+  r->next = kc->zlist;
+  kc->zlist = r;
+  kc->nz++;
+  release(&kc->lock);
+  return 1;
+}
+
+// How many pages are free, counting those in the cpu caches
+// and the zeroed pool. Read without locks, so only a hint.
+uint64
+kfreepages(void)
+{
+  uint64 n;
+
+  n = __atomic_load_n(&kmem.nfree, __ATOMIC_RELAXED);
+  for(struct kcache *kc = kcache; kc < &kcache[NCPU]; kc++){
+    n += __atomic_load_n(&kc->n, __ATOMIC_RELAXED);
+    n += __atomic_load_n(&kc->nz, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+// Print allocator statistics. For debugging.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kallocdump(void)
+{
+  struct kcache *kc;
+
+  printf("kalloc: global lock %d\n", (int)kmem.nlock);
+  for(kc = kcache; kc < &kcache[NCPU]; kc++){
+    if(kc->nhit == 0 && kc->nmiss == 0 && kc->n == 0 && kc->nz == 0)
+      continue;
+    printf("cpu%d: cached %d hits %d misses %d steals %d"
+           " zeroed %d hits %d misses %d\n",
+           (int)(kc - kcache), kc->n, (int)kc->nhit, (int)kc->nmiss,
+           (int)kc->nsteal, kc->nz, (int)kc->nzhit, (int)kc->nzmiss);
+  }
+}
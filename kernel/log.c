@@ -28,7 +28,12 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous, but the blocks of a commit are
+// written LOGBATCH at a time, so the disk has several to work on.
+
+// Writes write_log() and install_trans() have in flight at once.
+// Each keeps a buffer locked until it is done.
+#define LOGBATCH 8
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -68,17 +73,30 @@ initlog(int dev, struct superblock *sb)
 static void
 install_trans(int recovering)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  struct buf *dbuf[LOGBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if (n > LOGBATCH)
+      n = LOGBATCH;
+    // Log blocks are cached unless we are recovering.
+    for (i = 0; i < n; i++)
+      breadahead(log.dev, log.start+tail+i+1);
+    bkick();
+    for (i = 0; i < n; i++) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+i+1); // read log block
+      dbuf[i] = bread(log.dev, log.lh.block[tail+i]); // read dst
+      memmove(dbuf[i]->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+      bwrite_start(dbuf[i]);  // write dst to disk
+    }
+    for (i = 0; i < n; i++) {
+      bwait(dbuf[i]);
+      if(recovering == 0)
+        bunpin(dbuf[i]);
+      brelse(dbuf[i]);
+    }
   }
 }
 
@@ -178,15 +196,24 @@ end_op(void)
 static void
 write_log(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *to[LOGBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if (n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      to[i] = bread(log.dev, log.start+tail+i+1); // log block
+      struct buf *from = bread(log.dev, log.lh.block[tail+i]); // cache block
+      memmove(to[i]->data, from->data, BSIZE);
+      brelse(from);
+      bwrite_start(to[i]);  // write the log
+    }
+    for (i = 0; i < n; i++) {
+      bwait(to[i]);
+      brelse(to[i]);
+    }
   }
 }
 
@@ -16,6 +16,7 @@ main()
     printf("\n");
     printf("EEE3535 Operating Systems: booting xv6-riscv kernel\n");
     kinit();         // physical page allocator
+    kmallocinit();   // small object allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -26,7 +27,13 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    vmainit();       // file mappings and page cache
+    futexinit();     // futex wait locks
     virtio_disk_init(); // emulated hard disk
+#ifdef MEMBENCH
+    membench();      // time the string routines
+#endif
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
@@ -0,0 +1,131 @@
+// Throughput of memset(), memmove() and memcmp() in string.c,
+// against the byte-at-a-time loops they replaced, in bytes per
+// 100 cycles of rdcycle. Built into every kernel, but only run,
+// once at boot, by a kernel made with MEMBENCH=1.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFORDER 4                   // 64 KB buffers
+#define BUFSIZE (PGSIZE << BUFORDER)
+#define NBYTES (1 << 21)             // bytes per measurement
+
+// The old versions, for comparison.
+
+__attribute__((noinline)) static void *
+bytememset(void *dst, int c, uint n)
+{
+  char *cdst = (char *) dst;
+  int i;
+  for(i = 0; i < n; i++){
+    cdst[i] = c;
+  }
+  return dst;
+}
+
+__attribute__((noinline)) static int
+bytememcmp(const void *v1, const void *v2, uint n)
+{
+  const uchar *s1, *s2;
+
+  s1 = v1;
+  s2 = v2;
+  while(n-- > 0){
+    if(*s1 != *s2)
+      return *s1 - *s2;
+    s1++, s2++;
+  }
+
+  return 0;
+}
+
+__attribute__((noinline)) static void *
+bytememmove(void *dst, const void *src, uint n)
+{
+  const char *s;
+  char *d;
+
+  if(n == 0)
+    return dst;
+
+  s = src;
+  d = dst;
+  if(s < d && s + n > d){
+    s += n;
+    d += n;
+    while(n-- > 0)
+      *--d = *--s;
+  } else
+    while(n-- > 0)
+      *d++ = *s++;
+
+  return dst;
+}
+
+enum { SET, MOVE, CMP };
+static char *names[] = { "memset ", "memmove", "memcmp " };
+
+// Bytes per 100 cycles for op on n-byte buffers at dst
+// and src, with the new routines if fast is set.
+static uint64
+rate(int op, int fast, char *dst, char *src, uint n)
+{
+  uint64 start, cycles;
+  int i, iters = NBYTES / n;
+
+  start = r_cycle();
+  for(i = 0; i < iters; i++){
+    switch(op){
+    case SET:
+      fast ? memset(dst, i, n) : bytememset(dst, i, n);
+      break;
+    case MOVE:
+      fast ? memmove(dst, src, n) : bytememmove(dst, src, n);
+      break;
+    case CMP:
+      if((fast ? memcmp(dst, src, n) : bytememcmp(dst, src, n)) != 0)
+        panic("membench: memcmp");
+      break;
+    }
+  }
+  cycles = r_cycle() - start;
+  if(cycles == 0)
+    cycles = 1;
+  return (uint64)iters * n * 100 / cycles;
+}
+
+void
+membench(void)
+{
+  static uint sizes[] = { 16, 64, 256, 1024, 4096, 65536 - 8 };
+  char *dst, *src;
+  uint n;
+  int op, i, off;
+
+  dst = kalloc_order(BUFORDER);
+  src = kalloc_order(BUFORDER);
+  if(dst == 0 || src == 0)
+    panic("membench: kalloc");
+  memset(src, 'x', BUFSIZE);
+
+  printf("membench: bytes per 100 cycles, old -> new\n");
+  for(op = SET; op <= CMP; op++){
+    for(i = 0; i < NELEM(sizes); i++){
+      n = sizes[i];
+      // aligned, then dst off by 3 from src.
+      for(off = 0; off <= 3; off += 3){
+        if(op == CMP)
+          memmove(dst + off, src, n);
+        printf("membench: %s %d%s: %d -> %d\n", names[op], n,
+               off ? " unaligned" : "",
+               (int)rate(op, 0, dst + off, src, n),
+               (int)rate(op, 1, dst + off, src, n));
+      }
+    }
+  }
+
+  kfree_order(dst, BUFORDER);
+  kfree_order(src, BUFORDER);
+}
@@ -27,6 +27,7 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // software interrupt (IPI)
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -62,6 +63,18 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   thread stacks, each above an invalid guard page
+//   ...
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME(p) (TRAMPOLINE - ((p+1)*2-1)*PGSIZE)
+
+// thread stacks sit below the trapframes of all NPROC slots.
+// tfork() hands out slot i of a process's stack area; the slot
+// is a guard page followed by TSTACKPAGES of stack, and
+// TSTACK(i) is the lowest address of the stack proper.
+#define TSTACKPAGES 4
+#define TSTACKSIZE ((TSTACKPAGES+1)*PGSIZE)
+#define TSTACKTOP (TRAMPOLINE - 2*(NPROC+1)*PGSIZE)
+#define TSTACKBASE (TSTACKTOP - NPROC*TSTACKSIZE)
+#define TSTACK(i) (TSTACKTOP - ((i)+1)*TSTACKSIZE + PGSIZE)
@@ -7,9 +7,15 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
 #define PIPESIZE 512
 
+// User memory is copied through a buffer on the kernel stack,
+// this much at a time, so that pi->lock is not held while
+// copyin()/copyout() fault pages in, which may sleep.
+#define PIPECHUNK 128
+
 struct pipe {
   struct spinlock lock;
   char data[PIPESIZE];
@@ -19,6 +25,20 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+struct kmem_cache pipecache;
+
+static void
+pipector(void *p)
+{
+  initlock(&((struct pipe*)p)->lock, "pipe");
+}
+
+void
+pipeinit(void)
+{
+  kmem_cache_init(&pipecache, "pipe", sizeof(struct pipe), pipector);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,13 +48,12 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmem_cache_alloc(&pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
-  initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,7 +66,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(&pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,7 +87,7 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(&pipecache, pi);
   } else
     release(&pi->lock);
 }
@@ -76,28 +95,40 @@ pipeclose(struct pipe *pi, int writable)
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, j, m;
   struct proc *pr = myproc();
+  char buf[PIPECHUNK];
 
-  acquire(&pi->lock);
   while(i < n){
-    if(pi->readopen == 0 || killed(pr)){
-      release(&pi->lock);
-      return -1;
-    }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+    m = n - i;
+    if(m > PIPECHUNK)
+      m = PIPECHUNK;
+    if(copyin(pr->mm->pagetable, buf, addr + i, m) == -1)
+      break;
+
+    acquire(&pi->lock);
+    for(j = 0; j < m; ){
+      if(pi->readopen == 0 || killed(pr)){
+        // we may have been handed the turn; pass it on.
+        wakeup_one(&pi->nread);
+        wakeup_one(&pi->nwrite);
+        release(&pi->lock);
+        return -1;
+      }
+      if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+        wakeup_one(&pi->nread);
+        sleep(&pi->nwrite, &pi->lock);
+      } else
+        pi->data[pi->nwrite++ % PIPESIZE] = buf[j++];
     }
+    i += m;
+    wakeup_one(&pi->nread);
+    // readers and writers are woken one at a time; pass the
+    // turn on to another writer if there is still room.
+    if(pi->nwrite != pi->nread + PIPESIZE)
+      wakeup_one(&pi->nwrite);
+    release(&pi->lock);
   }
-  wakeup(&pi->nread);
-  release(&pi->lock);
 
   return i;
 }
@@ -105,26 +136,41 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m, r;
   struct proc *pr = myproc();
-  char ch;
+  char buf[PIPECHUNK];
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(killed(pr)){
+      // we may have been handed the turn; pass it on.
+      wakeup_one(&pi->nread);
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
+  // take whatever is there, up to n, a buffer at a time.
+  for(i = 0; i < n; i += m){
+    for(m = 0; m < PIPECHUNK && i + m < n; m++){  //DOC: piperead-copy
+      if(pi->nread == pi->nwrite)
+        break;
+      buf[m] = pi->data[pi->nread++ % PIPESIZE];
+    }
+    if(m == 0)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    wakeup_one(&pi->nwrite);  //DOC: piperead-wakeup
+    release(&pi->lock);
+    r = copyout(pr->mm->pagetable, addr + i, buf, m);
+    acquire(&pi->lock);
+    if(r == -1){
+      i = -1;
       break;
+    }
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  // pass the turn on to another reader if data is left.
+  if(pi->nread != pi->nwrite)
+    wakeup_one(&pi->nread);
   release(&pi->lock);
   return i;
 }
@@ -4,12 +4,19 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "vma.h"
+#include "slab.h"
 #include "defs.h"
 
 ////// Assignment 6 : Thread //////
 #include "user/uthread.h"
 ///////////////////////////////////
 
+// Thread stack slots are tracked in 64-bit masks.
+#if NPROC > 64
+#error "NPROC too large for thread stack masks"
+#endif
+
 struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
@@ -22,10 +29,44 @@ struct spinlock pid_lock;
 int nexttid = 1;
 struct spinlock tid_lock;
 
+// Address spaces, each shared by the threads of one process.
+// A process in exec() briefly holds two, so they come from a
+// cache rather than a table of NPROC. lock protects mm->ref.
+struct {
+	struct spinlock lock;
+	struct kmem_cache mmcache;
+} mmtable;
+
+// Sleeping processes are kept in a hash table of wait queues,
+// keyed by channel, so that wakeup() only looks at processes that
+// might be sleeping on its channel.
+// Lock order: the sleeper's condition lock, then the wait queue
+// lock, then p->lock.
+#define NWAITQ 64
+
+struct waitq {
+	struct spinlock lock;
+	struct proc *head;
+} waitq[NWAITQ];
+
+// How many more queued processes a process's previous cpu may
+// have than the waking cpu before cache affinity is given up.
+#define AFFINITY_SLACK 2
+
 extern void forkret(void);
 
 static void freeproc(struct proc *p);
 
+static void setrunnable(struct proc *p);
+
+static void exitthreads(struct proc *g);
+
+static void killproc(struct proc *p);
+
+static void tstackfree(struct proc *t);
+
+static void mmctor(void *mm);
+
 extern char trampoline[]; // trampoline.S
 
 // helps ensure that wakeups of wait()ing
@@ -54,19 +95,29 @@ proc_mapstacks(pagetable_t kpgtbl) {
 void
 procinit(void) {
 	struct proc *p;
+	struct cpu *c;
 
 	initlock(&pid_lock, "nextpid");
 	initlock(&wait_lock, "wait_lock");
 
 	////// Assignment 6 : Thread //////
 	initlock(&tid_lock, "nexttid");
+	initlock(&mmtable.lock, "mmtable");
+	kmem_cache_init(&mmtable.mmcache, "mm", sizeof(struct mm), mmctor);
 	///////////////////////////////////
 
 	for (p = proc; p < &proc[NPROC]; p++) {
 		initlock(&p->lock, "proc");
+		initlock(&p->tlock, "thread group");
 		p->state = UNUSED;
 		p->kstack = KSTACK((int)(p - proc));
 	}
+
+	for (c = cpus; c < &cpus[NCPU]; c++)
+		initlock(&c->rq.lock, "runq");
+
+	for (int i = 0; i < NWAITQ; i++)
+		initlock(&waitq[i].lock, "waitq");
 }
 
 // Must be called with interrupts disabled,
@@ -97,6 +148,172 @@ myproc(void) {
 	return p;
 }
 
+// Each cpu's run queue is a deque. The owning cpu queues and runs
+// processes at the head end in FIFO order; an idle cpu steals from
+// the tail end of the busiest queue. rq.len may be read without the
+// lock as a hint, so a cpu only locks the one queue it works on.
+
+// Unlocked read of c's run queue length.
+static int
+runq_len(struct cpu *c) {
+	return __atomic_load_n(&c->rq.len, __ATOMIC_RELAXED);
+}
+
+// Append p to the tail of c's run queue.
+static void
+runq_push(struct cpu *c, struct proc *p) {
+	acquire(&c->rq.lock);
+	p->rqnext = 0;
+	p->rqprev = c->rq.tail;
+	if (c->rq.tail)
+		c->rq.tail->rqnext = p;
+	else
+		c->rq.head = p;
+	c->rq.tail = p;
+	c->rq.len++;
+	release(&c->rq.lock);
+}
+
+// Unlink p from c's run queue.
+// Caller must hold c->rq.lock.
+static void
+runq_unlink(struct cpu *c, struct proc *p) {
+	if (p->rqprev)
+		p->rqprev->rqnext = p->rqnext;
+	else
+		c->rq.head = p->rqnext;
+	if (p->rqnext)
+		p->rqnext->rqprev = p->rqprev;
+	else
+		c->rq.tail = p->rqprev;
+	p->rqnext = p->rqprev = 0;
+	c->rq.len--;
+}
+
+// Remove and return the process at the head of c's run queue,
+// or 0 if the queue is empty.
+static struct proc *
+runq_pop(struct cpu *c) {
+	struct proc *p;
+
+	if (runq_len(c) == 0)
+		return 0;
+
+	acquire(&c->rq.lock);
+	if ((p = c->rq.head) != 0)
+		runq_unlink(c, p);
+	release(&c->rq.lock);
+	return p;
+}
+
+// Steal the most recently queued process from the cpu with the
+// longest run queue. Called by c when its own queue is empty.
+// Returns 0 if there was nothing to steal.
+static struct proc *
+runq_steal(struct cpu *c) {
+	struct cpu *victim, *o;
+	struct proc *p;
+	int len, max;
+
+	victim = 0;
+	max = 0;
+	for (o = cpus; o < &cpus[NCPU]; o++) {
+		if (o != c && (len = runq_len(o)) > max) {
+			victim = o;
+			max = len;
+		}
+	}
+	if (victim == 0)
+		return 0;
+
+	acquire(&victim->rq.lock);
+	if ((p = victim->rq.tail) != 0)
+		runq_unlink(victim, p);
+	release(&victim->rq.lock);
+
+	if (p)
+		c->nsteal++;
+	return p;
+}
+
+// Send an inter-processor interrupt to c through the CLINT.
+// timervec turns it into a supervisor software interrupt,
+// which wakes c from wfi.
+static void
+ipi(struct cpu *c) {
+	*(volatile uint32 *)CLINT_MSIP(c - cpus) = 1;
+}
+
+// Work has just been queued on c. If c is parked in wfi, wake it.
+// If c is busy running something else, wake a parked cpu instead,
+// so that it can steal the new work.
+static void
+runq_kick(struct cpu *c) {
+	struct cpu *o;
+	struct proc *cur;
+
+	// Order the queue update before the reads of idle;
+	// pairs with the barrier in cpu_idle().
+	__sync_synchronize();
+
+	if (__sync_bool_compare_and_swap(&c->idle, 1, 0)) {
+		ipi(c);
+		return;
+	}
+
+	if ((cur = c->proc) == 0 || cur->state != RUNNING || runq_len(c) == 0)
+		return;
+	for (o = cpus; o < &cpus[NCPU]; o++) {
+		if (o != c && __sync_bool_compare_and_swap(&o->idle, 1, 0)) {
+			ipi(o);
+			return;
+		}
+	}
+}
+
+// Nothing to run: park this hart in wfi, instead of spinning
+// on the run queues, until a clock tick, a device interrupt or
+// an IPI from runq_kick() arrives. The interrupt itself is taken
+// when scheduler() turns interrupts back on.
+static void
+cpu_idle(struct cpu *c) {
+	struct cpu *o;
+
+	intr_off();
+	c->idle = 1;
+	__sync_synchronize();
+
+	// Anything queued before idle became visible won't
+	// send an IPI, so look once more.
+	for (o = cpus; o < &cpus[NCPU]; o++) {
+		if (runq_len(o) > 0)
+			break;
+	}
+	if (o == &cpus[NCPU])
+		wfi();
+	c->idle = 0;
+}
+
+// Mark p RUNNABLE and queue it for a cpu.
+// Prefer the cpu p last ran on, whose cache may still hold its
+// working set, unless that cpu is noticeably busier than this one.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p) {
+	struct cpu *c;
+
+	if (!holding(&p->lock))
+		panic("setrunnable");
+	p->state = RUNNABLE;
+
+	c = mycpu();
+	if (p->lastcpu >= 0 && &cpus[p->lastcpu] != c &&
+		runq_len(&cpus[p->lastcpu]) <= runq_len(c) + AFFINITY_SLACK)
+		c = &cpus[p->lastcpu];
+	runq_push(c, p);
+	runq_kick(c);
+}
+
 int
 allocpid() {
 	int pid;
@@ -145,21 +362,12 @@ allocproc(void) {
 	found:
 	p->pid = allocpid();
 	p->state = USED;
+	p->lastcpu = -1;
 
 	////// Assignment 6 : Thread //////
 	p->tid = -1; // initialize thread id
-
-	p->rsz = 0;
-	p->sz = &(p->rsz);
-
-//	p->rcwd = 0;
-	p->cwd = &(p->rcwd);
-
-	for (int fd = 0; fd < NOFILE; fd++) {
-		p->rofile[fd] = 0;
-		p->ofile[fd] = &(p->rofile[fd]);
-	}
-
+	p->group = p; // a process leads its own thread group
+	p->tstack = -1;
 	///////////////////////////////////
 
 	// Allocate a trapframe page.
@@ -169,9 +377,9 @@ allocproc(void) {
 		return 0;
 	}
 
-	// An empty user page table.
-	p->pagetable = proc_pagetable(p);
-	if (p->pagetable == 0) {
+	// An empty user address space.
+	p->mm = proc_mm(p);
+	if (p->mm == 0) {
 		freeproc(p);
 		release(&p->lock);
 		return 0;
@@ -194,11 +402,17 @@ freeproc(struct proc *p) {
 	if (p->trapframe)
 		kfree((void *)p->trapframe);
 	p->trapframe = 0;
-	if (p->pagetable)
-		proc_freepagetable(p, p->pagetable, *(p->sz));
-	p->pagetable = 0;
 	////// Assignment 6 : Thread //////
-	p->rsz = 0;
+	if (p->mm) {
+		tstackfree(p);
+		proc_freemm(p, p->mm);
+	}
+	p->mm = 0;
+	p->tid = -1;
+	p->xret = 0;
+	p->group = 0;
+	p->threads = 0;
+	p->tnext = 0;
 	///////////////////////////////////
 	p->pid = 0;
 	p->parent = 0;
@@ -206,13 +420,20 @@ freeproc(struct proc *p) {
 	p->chan = 0;
 	p->killed = 0;
 	p->xstate = 0;
+	p->xset = 0;
 	p->state = UNUSED;
 }
 
-// Create a user page table for a given process, with no user memory,
-// but with trampoline and trapframe pages.
-pagetable_t
-proc_pagetable(struct proc *p) {
+static void
+mmctor(void *mm) {
+	initlock(&((struct mm *)mm)->lock, "mm");
+}
+
+// Allocate an address space with an empty user page table
+// that maps only the trampoline.
+static struct mm *
+mmalloc(void) {
+	struct mm *mm;
 	pagetable_t pagetable;
 
 	// An empty page table.
@@ -230,25 +451,304 @@ proc_pagetable(struct proc *p) {
 		return 0;
 	}
 
-	// map the trapframe page just below the trampoline page, for
-	// trampoline.S.
-	if (mappages(pagetable, TRAPFRAME(p - proc), PGSIZE,
-				 (uint64)(p->trapframe), PTE_R | PTE_W) < 0) {
+	if ((mm = kmem_cache_alloc(&mmtable.mmcache)) == 0) {
 		uvmunmap(pagetable, TRAMPOLINE, 1, 0);
 		uvmfree(pagetable, 0);
 		return 0;
 	}
+	mm->ref = 1;
+	mm->pagetable = pagetable;
+	mm->sz = 0;
+	mm->tstackused = 0;
+	mm->tstackmapped = 0;
+	mm->vmas = 0;
+	mm->nfault = 0;
+	mm->dead = 0;
+	return mm;
+}
 
-	return pagetable;
+// Increment ref count for address space mm.
+static struct mm *
+mmdup(struct mm *mm) {
+	acquire(&mmtable.lock);
+	if (mm->ref < 1)
+		panic("mmdup");
+	mm->ref++;
+	release(&mmtable.lock);
+	return mm;
 }
 
-// Free a process's page table, and free the
-// physical memory it refers to.
+// Unmap and free the pages of every vma on list v, e.g. the
+// mmap()s above the heap, which uvmfree() does not cover.
+static void
+mm_unmapvmas(pagetable_t pagetable, struct vma *v) {
+	for (; v; v = v->next)
+		uvmunmap(pagetable, v->start, (PGROUNDUP(v->end) - v->start) / PGSIZE, 1);
+}
+
+// Share va [va, end) of mm with address space nmm, which
+// nobody uses yet, copy-on-write. A megapage's worth at a time,
+// so that mm->lock is not held, with interrupts off, across
+// the whole of a large address space.
+static int
+mm_copy(struct mm *mm, struct mm *nmm, uint64 va, uint64 end) {
+	uint64 a, next;
+	int r = 0;
+
+	for (a = va; a < end && r == 0; a = next) {
+		next = MPGROUNDDOWN(a) + MPGSIZE;
+		if (next > end)
+			next = end;
+		acquire(&mm->lock);
+		r = uvmcopy(mm->pagetable, nmm->pagetable, a, next);
+		release(&mm->lock);
+	}
+	return r;
+}
+
+// Drop a reference to address space mm; the last one frees
+// its page table and the physical memory it refers to,
+// including any cached thread stacks, and its vmas.
+static void
+mmput(struct mm *mm) {
+	struct mm m;
+
+	acquire(&mmtable.lock);
+	if (mm->ref < 1)
+		panic("mmput");
+	if (--mm->ref > 0) {
+		release(&mmtable.lock);
+		return;
+	}
+	m = *mm;
+	release(&mmtable.lock);
+	kmem_cache_free(&mmtable.mmcache, mm);
+
+	for (int i = 0; i < NPROC; i++) {
+		if (m.tstackmapped & (1UL << i))
+			uvmunmap(m.pagetable, TSTACK(i), TSTACKPAGES, 1);
+	}
+	uvmunmap(m.pagetable, TRAMPOLINE, 1, 0);
+	mm_unmapvmas(m.pagetable, m.vmas);
+	uvmfree(m.pagetable, m.sz);
+	vma_freelist(m.vmas);
+	vma_freelist(m.dead);
+}
+
+// Drop the vmas of address space mm if p is the last process
+// using it, while p can still sleep for the iput()s; the
+// mmput() in freeproc() cannot.
+static void
+mm_dropvmas(struct mm *mm) {
+	struct vma *v;
+	int last;
+
+	acquire(&mmtable.lock);
+	last = (mm->ref == 1);
+	release(&mmtable.lock);
+	if (!last)
+		return;
+
+	acquire(&mm->lock);
+	v = mm->vmas;
+	mm->vmas = 0;
+	mm_unmapvmas(mm->pagetable, v);
+	release(&mm->lock);
+	vma_freelist(v);
+}
+
+// Map p's trapframe page into address space mm, for trampoline.S.
+static int
+mm_maptrapframe(struct mm *mm, struct proc *p) {
+	int r;
+
+	acquire(&mm->lock);
+	r = mappages(mm->pagetable, TRAPFRAME(p - proc), PGSIZE,
+				 (uint64)(p->trapframe), PTE_R | PTE_W);
+	release(&mm->lock);
+	return r;
+}
+
+// Create a user address space for a given process, with no user
+// memory, but with trampoline and trapframe pages.
+struct mm *
+proc_mm(struct proc *p) {
+	struct mm *mm;
+
+	if ((mm = mmalloc()) == 0)
+		return 0;
+	if (mm_maptrapframe(mm, p) < 0) {
+		mmput(mm);
+		return 0;
+	}
+	return mm;
+}
+
+// Take process p out of address space mm, freeing the
+// address space if p was the last process using it.
+void
+proc_freemm(struct proc *p, struct mm *mm) {
+	acquire(&mm->lock);
+	uvmunmap(mm->pagetable, TRAPFRAME(p - proc), 1, 0);
+	release(&mm->lock);
+	mmput(mm);
+}
+
+// Handle a fault on user virtual address va in page table
+// pagetable, which must belong to the current process: either
+// a page fault trap from user mode, or an access by copyin()
+// or copyout(). write is set for a store.
+// Returns 0 if the access can now be retried, -1 if it is
+// an error.
+int
+pagefault(pagetable_t pagetable, uint64 va, int write) {
+	struct proc *p = myproc();
+	struct mm *mm;
+	struct vma *v;
+	uint64 a;
+	char *mega = 0;
+	int r = -1, tried = 0;
+
+	if (p == 0 || (mm = p->mm) == 0 || mm->pagetable != pagetable)
+		return -1;
+	if (va >= MAXVA)
+		return -1;
+	va = PGROUNDDOWN(va);
+	a = MPGROUNDDOWN(va);
+
+	again:
+	acquire(&mm->lock);
+	if (!uvmmapped(pagetable, va)) {
+		// Part of a file, e.g. a program exec() has not read
+		// in yet, or of an mmap(). Releases mm->lock.
+		if ((v = vma_find(mm, va)) != 0) {
+			if (mega)
+				kfree_order(mega, MPGORDER);
+			return vma_fault(mm, v, va);
+		}
+		// Heap memory that sbrk() has not allocated yet; a
+		// whole megapage of it if the heap covers one. The
+		// megapage is zeroed without mm->lock, then the
+		// checks are made again.
+		if (va < mm->sz) {
+			if (a + MPGSIZE <= mm->sz && !vma_overlaps(mm, a, a + MPGSIZE) &&
+				uvmcanmega(pagetable, a)) {
+				if (mega == 0 && !tried) {
+					release(&mm->lock);
+					mega = uvmallocmega();
+					tried = 1;
+					goto again;
+				}
+				if (mega && uvmmapmega(pagetable, a, mega, PTE_R | PTE_W | PTE_U) == 0) {
+					mega = 0;
+					r = 0;
+				}
+			}
+			if (r < 0)
+				r = uvmzero(pagetable, va);
+		}
+	} else if (write) {
+		r = uvmcow(pagetable, va);
+	}
+	release(&mm->lock);
+	if (mega)
+		kfree_order(mega, MPGORDER);
+	return r;
+}
+
+// Make every other cpu that is running user code with page
+// table pagetable flush its TLB, after some of pagetable's
+// mappings were taken away or made read-only. A cpu flushes
+// whenever it returns to user space (see userret), so it is
+// enough to interrupt those in user mode and wait for them
+// to trap. A cpu in user mode always takes the interrupt,
+// so this cannot deadlock whatever locks the caller holds.
+void
+tlbshootdown(pagetable_t pagetable) {
+	struct cpu *c, *me;
+	uint seen[NCPU];
+	int sent[NCPU];
+
+	push_off();
+	me = mycpu();
+
+	// PTE updates before the reads of upagetable.
+	__sync_synchronize();
+
+	for (c = cpus; c < &cpus[NCPU]; c++) {
+		sent[c - cpus] = 0;
+		if (c != me && c->upagetable == pagetable) {
+			seen[c - cpus] = __atomic_load_n(&c->ntrap, __ATOMIC_ACQUIRE);
+			sent[c - cpus] = 1;
+			ipi(c);
+		}
+	}
+	for (c = cpus; c < &cpus[NCPU]; c++) {
+		if (!sent[c - cpus])
+			continue;
+		while (__atomic_load_n(&c->upagetable, __ATOMIC_ACQUIRE) == pagetable &&
+			   __atomic_load_n(&c->ntrap, __ATOMIC_ACQUIRE) == seen[c - cpus])
+			;
+	}
+	pop_off();
+}
+
+// Switch process p to address space mm, e.g. after exec.
+// p's thread stack, if any, is left for the old address space
+// to reuse; that space is freed if nothing else uses it.
 void
-proc_freepagetable(struct proc *p, pagetable_t pagetable, uint64 sz) {
-	uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-	uvmunmap(pagetable, TRAPFRAME(p - proc), 1, 0);
-	uvmfree(pagetable, sz);
+proc_setmm(struct proc *p, struct mm *mm) {
+	struct mm *oldmm = p->mm;
+
+	tstackfree(p);
+	p->mm = mm;
+	proc_freemm(p, oldmm);
+}
+
+// Give out a free thread stack slot in address space mm,
+// preferring one whose pages are still mapped from an earlier
+// thread, so that short-lived threads don't rebuild page tables.
+// Returns the slot number, or -1.
+static int
+tstackalloc(struct mm *mm) {
+	uint64 free, cached;
+	int i;
+
+	acquire(&mm->lock);
+	free = ~mm->tstackused;
+	cached = free & mm->tstackmapped;
+	for (i = 0; i < NPROC; i++) {
+		if ((cached ? cached : free) & (1UL << i))
+			break;
+	}
+	if (i == NPROC) {
+		release(&mm->lock);
+		return -1;
+	}
+
+	if ((mm->tstackmapped & (1UL << i)) == 0) {
+		if (uvmalloc(mm->pagetable, TSTACK(i),
+					 TSTACK(i) + TSTACKPAGES * PGSIZE, PTE_W) == 0) {
+			release(&mm->lock);
+			return -1;
+		}
+		mm->tstackmapped |= 1UL << i;
+	}
+	mm->tstackused |= 1UL << i;
+	release(&mm->lock);
+	return i;
+}
+
+// Give thread t's stack slot back to its address space,
+// which keeps the pages mapped for the next thread.
+static void
+tstackfree(struct proc *t) {
+	if (t->tstack < 0)
+		return;
+	acquire(&t->mm->lock);
+	t->mm->tstackused &= ~(1UL << t->tstack);
+	release(&t->mm->lock);
+	t->tstack = -1;
 }
 
 // a user program that calls exec("/init")
@@ -274,37 +774,53 @@ userinit(void) {
 
 	// allocate one user page and copy initcode's instructions
 	// and data into it.
-	uvmfirst(p->pagetable, initcode, sizeof(initcode));
-	p->rsz = PGSIZE;
+	uvmfirst(p->mm->pagetable, initcode, sizeof(initcode));
+	p->mm->sz = PGSIZE;
 
 	// prepare for the very first "return" from kernel to user.
 	p->trapframe->epc = 0;      // user program counter
 	p->trapframe->sp = PGSIZE;  // user stack pointer
 
 	safestrcpy(p->name, "initcode", sizeof(p->name));
-	p->rcwd = namei("/");
+	if ((p->files = filesalloc()) == 0)
+		panic("userinit: files");
+	p->files->cwd = namei("/");
 
-	p->state = RUNNABLE;
+	setrunnable(p);
 
 	release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only moves the break; pagefault() allocates
+// the pages when they are first touched.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n) {
 	uint64 sz;
-	struct proc *p = myproc();
+	struct mm *mm = myproc()->mm;
 
-	sz = *(p->sz);
+	acquire(&mm->lock);
+	sz = mm->sz;
 	if (n > 0) {
-		if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+		// The heap must not run into mmap()s or the thread stacks.
+		if (sz + n < sz || sz + n > TSTACKBASE || vma_overlaps(mm, sz, sz + n)) {
+			release(&mm->lock);
 			return -1;
 		}
+		sz += n;
 	} else if (n < 0) {
-		sz = uvmdealloc(p->pagetable, sz, sz + n);
+		// Keep the part of a megapage below the new end.
+		if (sz + n > sz || (PGROUNDUP(sz + n) % MPGSIZE != 0 &&
+							uvmsplit(mm->pagetable, PGROUNDUP(sz + n)) < 0)) {
+			release(&mm->lock);
+			return -1;
+		}
+		sz = uvmdealloc(mm->pagetable, sz, sz + n);
+		tlbshootdown(mm->pagetable);
 	}
-	*(p->sz) = sz;
+	mm->sz = sz;
+	release(&mm->lock);
 	return 0;
 }
 
@@ -313,6 +829,8 @@ growproc(int n) {
 int
 fork(void) {
 	int i, pid;
+	uint64 sz, va;
+	struct vma *v;
 	struct proc *np;
 	struct proc *p = myproc();
 
@@ -321,14 +839,51 @@ fork(void) {
 		return -1;
 	}
 
-	// Copy user memory from parent to child.
-	if (uvmcopy(p->pagetable, np->pagetable, *(p->sz)) < 0) {
-		freeproc(np);
-		release(&np->lock);
-		return -1;
+	// Nobody else looks at np until it has a parent and is
+	// RUNNABLE, so it can go unlocked while the address space
+	// is copied.
+	release(&np->lock);
+
+	// The child faults in what the parent has not touched yet
+	// from the same files. Sizes and vmas first, so that
+	// mmput() frees whatever gets copied if a copy fails.
+	acquire(&p->mm->lock);
+	if (vma_dup(np->mm, p->mm->vmas) < 0) {
+		release(&p->mm->lock);
+		goto bad;
+	}
+	sz = np->mm->sz = p->mm->sz;
+	release(&p->mm->lock);
+
+	// Share user memory with the child, copy-on-write.
+	if (mm_copy(p->mm, np->mm, 0, sz) < 0)
+		goto bad;
+
+	// And the pages of mmap()s above the heap; MAP_SHARED
+	// ones stay shared. np's copy of the vma list is walked,
+	// since nobody else can change it.
+	for (v = np->mm->vmas; v; v = v->next) {
+		va = v->start > PGROUNDUP(sz) ? v->start : PGROUNDUP(sz);
+		if (va < v->end && mm_copy(p->mm, np->mm, va, PGROUNDUP(v->end)) < 0)
+			goto bad;
+	}
+
+	// Threads are not forked, but a thread that forks takes its
+	// own stack along, as the child's only thread runs on it.
+	if (p->tstack >= 0) {
+		va = TSTACK(p->tstack);
+		np->mm->tstackmapped = np->mm->tstackused = 1UL << p->tstack;
+		np->tstack = p->tstack;
+		if (mm_copy(p->mm, np->mm, va, va + TSTACKPAGES * PGSIZE) < 0)
+			goto bad;
 	}
-	np->rsz = p->rsz;
-	np->sz = &(np->rsz);
+
+	// The parent's pages are read-only now; make sure its other
+	// threads see that before the child can run.
+	tlbshootdown(p->mm->pagetable);
+
+	if ((np->files = filesalloc()) == 0)
+		goto bad;
 
 	// copy saved user registers.
 	*(np->trapframe) = *(p->trapframe);
@@ -338,26 +893,89 @@ fork(void) {
 
 	// increment reference counts on open file descriptors.
 	for (i = 0; i < NOFILE; i++)
-		if (p->rofile[i])
-			np->rofile[i] = filedup(p->rofile[i]);
-	np->rcwd = idup(p->rcwd);
-	np->cwd = &(np->rcwd);
+		if (p->files->ofile[i])
+			np->files->ofile[i] = filedup(p->files->ofile[i]);
+	np->files->cwd = idup(p->files->cwd);
 
 	safestrcpy(np->name, p->name, sizeof(p->name));
 
 	pid = np->pid;
 
+	acquire(&wait_lock);
+	np->parent = p;
+	release(&wait_lock);
+
+	acquire(&np->lock);
+	setrunnable(np);
 	release(&np->lock);
 
+	return pid;
+
+	bad:
+	acquire(&np->lock);
+	freeproc(np);
+	release(&np->lock);
+	return -1;
+}
+
+// Create a new process running the program path with arguments
+// argv, without copying the caller's address space the way
+// fork() and exec() do. The child's descriptor i is a dup of
+// the caller's descriptor fdmap[i], or closed if that is -1;
+// with no fdmap it gets all of the caller's descriptors.
+// Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, int *fdmap) {
+	int i, r, pid;
+	struct file *f;
+	struct proc *np;
+	struct proc *p = myproc();
+
+	if ((np = allocproc()) == 0)
+		return -1;
+
+	// Nobody else looks at np until it has a parent and is
+	// RUNNABLE, so it can go unlocked while exec() sleeps.
+	release(&np->lock);
+
+	if ((np->files = filesalloc()) == 0)
+		goto bad;
+	for (i = 0; i < NOFILE; i++) {
+		if (fdmap)
+			f = fdmap[i] >= 0 ? p->files->ofile[fdmap[i]] : 0;
+		else
+			f = p->files->ofile[i];
+		if (f)
+			np->files->ofile[i] = filedup(f);
+	}
+	np->files->cwd = idup(p->files->cwd);
+
+	memset(np->trapframe, 0, sizeof(*np->trapframe));
+	if ((r = exec(np, path, argv)) < 0)
+		goto bad;
+	np->trapframe->a0 = r;
+
+	pid = np->pid;
+
 	acquire(&wait_lock);
 	np->parent = p;
 	release(&wait_lock);
 
 	acquire(&np->lock);
-	np->state = RUNNABLE;
+	setrunnable(np);
 	release(&np->lock);
 
 	return pid;
+
+	bad:
+	if (np->files) {
+		filesput(np->files);
+		np->files = 0;
+	}
+	acquire(&np->lock);
+	freeproc(np);
+	release(&np->lock);
+	return -1;
 }
 
 // Pass p's abandoned children to init.
@@ -380,23 +998,35 @@ reparent(struct proc *p) {
 void
 exit(int status) {
 	struct proc *p = myproc();
+	struct proc *g = p->group;
 
 	if (p == initproc)
 		panic("init exiting");
 
-	// Close all open files.
-	for (int fd = 0; fd < NOFILE; fd++) {
-		if (*(p->ofile[fd])) {
-			struct file *f = *(p->ofile[fd]);
-			fileclose(f);
-			*(p->ofile[fd]) = 0;
-		}
+	////// Assignment 6 : Thread //////
+	// exit() from any thread ends the whole process; the main
+	// thread takes the others down before tearing anything down.
+	// The process exits with the status of the first exit(), not
+	// the -1 of the main thread dying because it was killed.
+	acquire(&g->lock);
+	if (!g->xset) {
+		g->xstate = status;
+		g->xset = 1;
+	}
+	release(&g->lock);
+	if (p->tid >= 0) {
+		killproc(g);
+		texit(0);
 	}
+	exitthreads(p);
+	///////////////////////////////////
+
+	// Close all open files, unless another thread still uses them.
+	filesput(p->files);
+	p->files = 0;
 
-	begin_op();
-	iput(*(p->cwd));
-	end_op();
-	*(p->cwd) = 0;
+	mm_dropvmas(p->mm);
+	vma_reap();
 
 	acquire(&wait_lock);
 
@@ -408,7 +1038,6 @@ exit(int status) {
 
 	acquire(&p->lock);
 
-	p->xstate = status;
 	p->state = ZOMBIE;
 
 	release(&wait_lock);
@@ -423,7 +1052,7 @@ exit(int status) {
 int
 wait(uint64 addr) {
 	struct proc *pp;
-	int havekids, pid;
+	int havekids, pid, xstate;
 	struct proc *p = myproc();
 
 	acquire(&wait_lock);
@@ -439,16 +1068,16 @@ wait(uint64 addr) {
 				havekids = 1;
 				if (pp->state == ZOMBIE) {
 					// Found one.
+					// copy the status out only after dropping the
+					// locks, since copyout() may fault a page in.
 					pid = pp->pid;
-					if (addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-											 sizeof(pp->xstate)) < 0) {
-						release(&pp->lock);
-						release(&wait_lock);
-						return -1;
-					}
+					xstate = pp->xstate;
 					freeproc(pp);
 					release(&pp->lock);
 					release(&wait_lock);
+					if (addr != 0 && copyout(p->mm->pagetable, addr, (char *)&xstate,
+											 sizeof(xstate)) < 0)
+						return -1;
 					return pid;
 				}
 				release(&pp->lock);
@@ -469,7 +1098,8 @@ wait(uint64 addr) {
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take the next process off this cpu's run queue,
+//    or steal one from the busiest cpu if the queue is empty.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -483,22 +1113,32 @@ scheduler(void) {
 		// Avoid deadlock by ensuring that devices can interrupt.
 		intr_on();
 
-		for (p = proc; p < &proc[NPROC]; p++) {
-			acquire(&p->lock);
-			if (p->state == RUNNABLE) {
-				// Switch to chosen process.  It is the process's job
-				// to release its lock and then reacquire it
-				// before jumping back to us.
-				p->state = RUNNING;
-				c->proc = p;
-				swtch(&c->context, &p->context);
-
-				// Process is done running for now.
-				// It should have changed its p->state before coming back.
-				c->proc = 0;
-			}
-			release(&p->lock);
+		if ((p = runq_pop(c)) == 0 && (p = runq_steal(c)) == 0) {
+			// Spend spare time zeroing pages for kalloc_zeroed(),
+			// or shrinking the buffer cache if memory is short,
+			// a bit at a time so new work is picked up promptly.
+			if (!kzero_refill() && !bshrink())
+				cpu_idle(c);
+			continue;
 		}
+
+		acquire(&p->lock);
+		if (p->state == RUNNABLE) {
+			// Switch to chosen process.  It is the process's job
+			// to release its lock and then reacquire it
+			// before jumping back to us.
+			p->state = RUNNING;
+			if (p->lastcpu >= 0 && p->lastcpu != cpuid())
+				c->nmigrate++;
+			p->lastcpu = cpuid();
+			c->proc = p;
+			swtch(&c->context, &p->context);
+
+			// Process is done running for now.
+			// It should have changed its p->state before coming back.
+			c->proc = 0;
+		}
+		release(&p->lock);
 	}
 }
 
@@ -533,7 +1173,7 @@ void
 yield(void) {
 	struct proc *p = myproc();
 	acquire(&p->lock);
-	p->state = RUNNABLE;
+	setrunnable(p);
 	sched();
 	release(&p->lock);
 }
@@ -558,69 +1198,144 @@ forkret(void) {
 	usertrapret();
 }
 
+// Return the wait queue for chan.
+static struct waitq *
+chanwq(void *chan) {
+	uint64 h = ((uint64)chan >> 3) * 0x9e3779b97f4a7c15UL;
+	return &waitq[(h >> 32) % NWAITQ];
+}
+
+// Link p onto wq. Caller must hold wq->lock.
+static void
+waitq_insert(struct waitq *wq, struct proc *p) {
+	p->wq = wq;
+	p->wqprev = 0;
+	p->wqnext = wq->head;
+	if (wq->head)
+		wq->head->wqprev = p;
+	wq->head = p;
+}
+
+// Unlink p from its wait queue. Caller must hold p->wq->lock.
+static void
+waitq_remove(struct proc *p) {
+	if (p->wqprev)
+		p->wqprev->wqnext = p->wqnext;
+	else
+		p->wq->head = p->wqnext;
+	if (p->wqnext)
+		p->wqnext->wqprev = p->wqprev;
+	p->wqnext = p->wqprev = 0;
+	p->wq = 0;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk) {
 	struct proc *p = myproc();
+	struct waitq *wq = chanwq(chan);
 
 	// Must acquire p->lock in order to
 	// change p->state and then call sched.
-	// Once we hold p->lock, we can be
+	// Once we hold wq->lock, we can be
 	// guaranteed that we won't miss any wakeup
-	// (wakeup locks p->lock),
+	// (wakeup locks wq->lock),
 	// so it's okay to release lk.
 
+	acquire(&wq->lock);
 	acquire(&p->lock);  //DOC: sleeplock1
 	release(lk);
 
 	// Go to sleep.
 	p->chan = chan;
+	waitq_insert(wq, p);
 	p->state = SLEEPING;
+	release(&wq->lock);
 
 	sched();
 
-	// Tidy up.
+	// Tidy up. wakeup() takes p off the queue, but kill() leaves
+	// it there. wq->lock comes before p->lock, so drop p->lock first.
+	release(&p->lock);
+	acquire(&wq->lock);
+	if (p->wq)
+		waitq_remove(p);
 	p->chan = 0;
+	release(&wq->lock);
 
 	// Reacquire original lock.
-	release(&p->lock);
 	acquire(lk);
 }
 
+// Wake up to max processes sleeping on chan, or all of them
+// if max is negative. Returns the number woken.
+static int
+wakeq(void *chan, int max) {
+	struct waitq *wq = chanwq(chan);
+	struct proc *p, *next;
+	int n = 0;
+
+	acquire(&wq->lock);
+	for (p = wq->head; p && (max < 0 || n < max); p = next) {
+		next = p->wqnext;
+		if (p->chan != chan)
+			continue;
+		acquire(&p->lock);
+		if (p->state == SLEEPING) {
+			setrunnable(p);
+			n++;
+		}
+		release(&p->lock);
+		// Processes that kill() already woke are dropped as well.
+		waitq_remove(p);
+	}
+	release(&wq->lock);
+	return n;
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan) {
-	struct proc *p;
+	wakeq(chan, -1);
+}
 
-	for (p = proc; p < &proc[NPROC]; p++) {
-		if (p != myproc()) {
-			acquire(&p->lock);
-			if (p->state == SLEEPING && p->chan == chan) {
-				p->state = RUNNABLE;
-			}
-			release(&p->lock);
-		}
-	}
+// Wake up one process sleeping on chan, for callers where
+// only one waiter can make progress at a time.
+// Returns 1 if a process was woken, 0 if none was sleeping.
+// Must be called without any p->lock.
+int
+wakeup_one(void *chan) {
+	return wakeq(chan, 1);
 }
 
-// Kill the process with the given pid.
+// Mark p killed and wake it if it is sleeping.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
+static void
+killproc(struct proc *p) {
+	acquire(&p->lock);
+	p->killed = 1;
+	if (p->state == SLEEPING) {
+		// Wake process from sleep().
+		setrunnable(p);
+	}
+	release(&p->lock);
+}
+
+// Kill the process with the given pid.
+// Its threads share the pid; killing the main thread
+// takes them down too (see exit()).
 int
 kill(int pid) {
 	struct proc *p;
 
 	for (p = proc; p < &proc[NPROC]; p++) {
 		acquire(&p->lock);
-		if (p->pid == pid) {
-			p->killed = 1;
-			if (p->state == SLEEPING) {
-				// Wake process from sleep().
-				p->state = RUNNABLE;
-			}
+		if (p->pid == pid && p->tid < 0 && p->state != UNUSED) {
 			release(&p->lock);
+			killproc(p);
 			return 0;
 		}
 		release(&p->lock);
@@ -652,7 +1367,7 @@ int
 either_copyout(int user_dst, uint64 dst, void *src, uint64 len) {
 	struct proc *p = myproc();
 	if (user_dst) {
-		return copyout(p->pagetable, dst, src, len);
+		return copyout(p->mm->pagetable, dst, src, len);
 	} else {
 		memmove((char *)dst, src, len);
 		return 0;
@@ -666,7 +1381,7 @@ int
 either_copyin(void *dst, int user_src, uint64 src, uint64 len) {
 	struct proc *p = myproc();
 	if (user_src) {
-		return copyin(p->pagetable, dst, src, len);
+		return copyin(p->mm->pagetable, dst, src, len);
 	} else {
 		memmove(dst, (char *)src, len);
 		return 0;
@@ -687,9 +1402,19 @@ procdump(void) {
 			[ZOMBIE]    "zombie"
 	};
 	struct proc *p;
+	struct cpu *c;
 	char *state;
 
 	printf("\n");
+	for (c = cpus; c < &cpus[NCPU]; c++) {
+		if (c->nsteal == 0 && c->nmigrate == 0 && c->rq.len == 0)
+			continue;
+		printf("cpu%d: runq %d steals %d migrations %d\n",
+			   (int)(c - cpus), c->rq.len, c->nsteal, c->nmigrate);
+	}
+	kallocdump();
+	kmemdump();
+	bcachedump();
 	for (p = proc; p < &proc[NPROC]; p++) {
 		if (p->state == UNUSED)
 			continue;
@@ -698,6 +1423,11 @@ procdump(void) {
 		else
 			state = "???";
 		printf("%d %s %s", p->pid, state, p->name);
+		// heap pages are allocated on first touch, so the size
+		// of the address space and its resident pages differ.
+		if (p->tid < 0 && p->mm)
+			printf(" vsz %dK rss %dK", (int)(p->mm->sz / 1024),
+				   (int)(uvmresident(p->mm->pagetable) * PGSIZE / 1024));
 		printf("\n");
 	}
 }
@@ -705,10 +1435,15 @@ procdump(void) {
 
 ////// Assignment 6 : Thread //////
 
+// Create a new thread in the calling thread's group, sharing
+// its address space, open files and current directory.
+// The thread starts at func(arg). Returns the new thread's tid,
+// or -1 if there is no free slot.
 int
 tfork(void *(*func)(void *), void *arg) {
 	struct proc *t;
 	struct proc *p = myproc();
+	struct proc *g = p->group;
 
 	// Search for unused slot for thread
 	for (t = proc; t < &proc[NPROC]; t++) {
@@ -725,87 +1460,194 @@ tfork(void *(*func)(void *), void *arg) {
 
 	// If unused slot found
 	found :
+	t->state = USED;
 
 	// Alloc tid
 	t->tid = alloctid();
 
 	// Set pid to parent's pid
 	t->pid = p->pid;
+	t->lastcpu = -1;
 
 	// Allocate trapframe page
 	if ((t->trapframe = (struct trapframe *)kalloc()) == 0) {
 		freeproc(t);
 		release(&t->lock);
-		return 0;
-	}
-
-	pagetable_t pagetable = t->pagetable = p->pagetable;
-
-	// map the trapframe page
-	if (mappages(pagetable, TRAPFRAME(t - proc), PGSIZE,
-				 (uint64)(t->trapframe), PTE_R | PTE_W) < 0) {
-		uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-		uvmfree(pagetable, 0);
-		return (0);
+		return (-1);
 	}
 
-	if (!pagetable) {
+	// map the trapframe page into the shared address space
+	if (mm_maptrapframe(p->mm, t) < 0) {
 		freeproc(t);
 		release(&t->lock);
-		return 0;
+		return (-1);
 	}
+	t->mm = mmdup(p->mm);
 
 	memset(&t->context, 0, sizeof(t->context));
 	t->context.ra = (uint64)forkret;
 	t->context.sp = t->kstack + PGSIZE;
 
-	t->sz = p->sz;
-
+	memset(t->trapframe, 0, sizeof(*t->trapframe));
 	t->trapframe->a0 = (uint64)arg;
 
-	// Copy file descriptors
-	for (int fd = 0; fd < NOFILE; fd++) {
-		if (p->ofile[fd]) {
-			t->ofile[fd] = p->ofile[fd];
-		}
-	}
-
-	// Copy current working directory
-	t->cwd = &(p->rcwd);
-
-
 	// Copy process name
 	safestrcpy(t->name, p->name, sizeof(p->name));
 
+	// Set initial program counter
+	t->trapframe->epc = (uint64)(func);
+
 	release(&t->lock);
 
-	acquire(&wait_lock);
-	t->parent = p;
-	release(&wait_lock);
+	// Take a stack.
+	if ((t->tstack = tstackalloc(t->mm)) < 0) {
+		acquire(&t->lock);
+		freeproc(t);
+		release(&t->lock);
+		return (-1);
+	}
+	t->trapframe->sp = TSTACK(t->tstack) + TSTACKPAGES * PGSIZE;
+
+	// Share file descriptors and current working directory.
+	t->files = filesdup(p->files);
 
+	// Join the thread group.
+	acquire(&g->tlock);
+	t->group = g;
+	t->tnext = g->threads;
+	g->threads = t;
+	release(&g->tlock);
+
+	// Another cpu may pick the thread up as soon as it is queued,
+	// so the trapframe must be complete by now.
 	acquire(&t->lock);
-	t->state = RUNNABLE;
+	setrunnable(t);
 	release(&t->lock);
 
-	// Set initial program counter
-	t->trapframe->epc = (uint64)(func);
+	return t->tid;
+}
 
-	// Set stack pointer
-	t->trapframe->sp = PGROUNDUP(p->trapframe->sp) + (t - p) * PGSIZE;
+// Wait for thread tid of the caller's group to exit, free its
+// slot, and copy its return value to user address ret if ret
+// is non-zero. Returns 0 on success, -1 if there is no such
+// thread or the caller was killed.
+int
+twait(thread_t tid, uint64 ret) {
+	struct proc *t, **tp;
+	struct proc *p = myproc();
+	struct proc *g = p->group;
+	uint64 xret;
 
-	return 0;
-}
+	acquire(&g->tlock);
 
+	for (;;) {
+		// Find the thread in the group's own list; another thread may
+		// have reaped it while we slept, so look again every time.
+		for (tp = &g->threads; (t = *tp) != 0; tp = &t->tnext) {
+			if (t->tid == tid)
+				break;
+		}
+		if (t == 0 || t == p) {
+			release(&g->tlock);
+			return -1;
+		}
 
-int
-twait(thread_t t, void **ret) {
-	return 0;
+		// make sure the thread isn't still in texit() or swtch().
+		acquire(&t->lock);
+		if (t->state == ZOMBIE) {
+			xret = t->xret;
+			*tp = t->tnext;
+			freeproc(t);
+			release(&t->lock);
+			release(&g->tlock);
+			if (ret != 0 && copyout(p->mm->pagetable, ret, (char *)&xret,
+									 sizeof(xret)) < 0)
+				return -1;
+			return 0;
+		}
+		release(&t->lock);
+
+		if (killed(p)) {
+			release(&g->tlock);
+			return -1;
+		}
+
+		// Wait for the thread to exit.
+		sleep(t, &g->tlock);
+	}
 }
 
+// Exit the calling thread, leaving ret for twait(). Does not return.
+// The main thread of a process exits the whole process instead.
 void
-texit(void *ret) {
+texit(uint64 ret) {
+	struct proc *t = myproc();
+	struct proc *g = t->group;
+
+	if (t == g)
+		exit(0);
+
+	// Drop the thread's share of the open files.
+	filesput(t->files);
+	t->files = 0;
+
+	// Give any children to init.
+	acquire(&wait_lock);
+	reparent(t);
+	release(&wait_lock);
+
+	acquire(&g->tlock);
+
+	// A joiner might be sleeping in twait(), or the main thread
+	// in exitthreads().
+	wakeup(t);
+	wakeup(&g->threads);
+
+	acquire(&t->lock);
+
+	t->xret = ret;
+	t->state = ZOMBIE;
+
+	release(&g->tlock);
 
+	// Jump into the scheduler, never to return.
+	sched();
+	panic("zombie texit");
 }
 
+// Kill the other threads of process g, wait for all of them to
+// exit, and free them. They share g's address space and files,
+// which exit() is about to tear down.
+static void
+exitthreads(struct proc *g) {
+	struct proc *t;
+	int alive;
+
+	acquire(&g->tlock);
+	for (;;) {
+		alive = 0;
+		for (t = g->threads; t; t = t->tnext) {
+			acquire(&t->lock);
+			if (t->state != ZOMBIE) {
+				alive = 1;
+				t->killed = 1;
+				if (t->state == SLEEPING)
+					setrunnable(t);
+			}
+			release(&t->lock);
+		}
+		if (!alive)
+			break;
+		sleep(&g->threads, &g->tlock);
+	}
+
+	while ((t = g->threads) != 0) {
+		g->threads = t->tnext;
+		acquire(&t->lock);
+		freeproc(t);
+		release(&t->lock);
+	}
+	release(&g->tlock);
+}
 
 ///////////////////////////////////
@@ -18,12 +18,26 @@ struct context {
 	uint64 s11;
 };
 
+// Per-CPU deque of RUNNABLE processes, linked through p->rqnext/rqprev.
+struct runq {
+	struct spinlock lock;
+	struct proc *head;          // Next process to run
+	struct proc *tail;          // Most recently queued process
+	int len;                    // Number of queued processes
+};
+
 // Per-CPU state.
 struct cpu {
 	struct proc *proc;          // The process running on this cpu, or null.
 	struct context context;     // swtch() here to enter scheduler().
 	int noff;                   // Depth of push_off() nesting.
 	int intena;                 // Were interrupts enabled before push_off()?
+	struct runq rq;             // RUNNABLE processes waiting for this cpu
+	int nsteal;                 // Processes stolen from other cpus' queues
+	int nmigrate;               // Processes run here that last ran elsewhere
+	int idle;                   // Parked in wfi until an interrupt arrives
+	pagetable_t upagetable;     // User page table while in user mode, or 0
+	uint ntrap;                 // Traps taken from user mode
 };
 
 extern struct cpu cpus[NCPU];
@@ -83,38 +97,77 @@ enum procstate {
 	UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE
 };
 
+// A user address space, shared by the threads of a process.
+struct mm {
+	int ref;                     // Reference count; mmtable.lock
+	pagetable_t pagetable;       // User page table
+
+	// lock must be held when using these:
+	struct spinlock lock;
+	uint64 sz;                   // Size of process memory (bytes)
+	uint64 tstackused;           // Thread stack slots in use
+	uint64 tstackmapped;         // Thread stack slots with pages mapped
+	struct vma *vmas;            // File mappings, filled in on demand
+	int nfault;                  // vma_fault()s reading a file
+	struct vma *dead;            // Unmapped vmas, freed when nfault is 0
+};
+
+// Open files and current directory, shared by the threads
+// of a process.
+struct files {
+	int ref;                     // Reference count; ftable.lock
+	struct file *ofile[NOFILE];  // Open files
+	struct inode *cwd;           // Current directory
+};
+
 // Per-process state
 struct proc {
 	struct spinlock lock;
 
 	// p->lock must be held when using these:
 	enum procstate state;        // Process state
-	void *chan;                  // If non-zero, sleeping on chan
 	int killed;                  // If non-zero, have been killed
 	int xstate;                  // Exit status to be returned to parent's wait
+	int xset;                    // Main thread only: xstate set by some exit()
 	int pid;                     // Process ID
+	int lastcpu;                 // Cpu this process last ran on, or -1
+
+	// the wait queue lock for chan must be held when using these:
+	void *chan;                  // If non-zero, sleeping on chan
+	struct waitq *wq;            // Wait queue p is linked on, or 0
+	struct proc *wqnext;         // Next process on the wait queue
+	struct proc *wqprev;         // Previous process on the wait queue
+
+	// owning cpu's rq.lock must be held when using these:
+	struct proc *rqnext;         // Next process on the run queue
+	struct proc *rqprev;         // Previous process on the run queue
 
 	////// Assignment 6 : Thread //////
 	int tid;                     // Thread ID
 	uint64 xret;                 // Thread exit status to be returned to parent's join
 	///////////////////////////////////
 
+	////// Assignment 6 : Thread //////
+	// group->tlock must be held when using these:
+	struct proc *group;          // Main thread of this thread's process
+	struct proc *threads;        // Main thread only: other threads in the group
+	struct proc *tnext;          // Next thread in the group
+	struct spinlock tlock;       // Main thread only: protects threads list
+	int tstack;                  // Thread stack slot (see TSTACK), or -1
+	///////////////////////////////////
+
 	// wait_lock must be held when using this:
 	struct proc *parent;         // Parent process
 
 	// these are private to the process, so p->lock need not be held.
 	uint64 kstack;               // Virtual address of kernel stack
+	int nilock;                  // Inode locks held (see canread() in vma.c)
 	////// Assignment 6 : Thread //////
-	uint64 *sz;                  // Size of process memory (bytes) - pointer
-	uint64 rsz;                  // Size of process memory (bytes) - real
+	struct mm *mm;               // User memory, shared with other threads
+	struct files *files;         // Open files and cwd, shared likewise
 	///////////////////////////////////
-	pagetable_t pagetable;       // User page table
 	struct trapframe *trapframe; // data page for trampoline.S
 	struct context context;      // swtch() here to run process
-	struct file **ofile[NOFILE]; // Open files - pointer
-	struct file *rofile[NOFILE]; // Open files - real
-	struct inode **cwd;          // Current directory - pointer
-	struct inode *rcwd;          // Current directory - real
 	char name[16];               // Process name (debugging)
 };
 
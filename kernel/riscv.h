@@ -241,6 +241,13 @@ r_stval()
   return x;
 }
 
+// Supervisor-mode Counter-Enable
+static inline void 
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
 // Machine-mode Counter-Enable
 static inline void 
 w_mcounteren(uint64 x)
@@ -256,6 +263,16 @@ r_mcounteren()
   return x;
 }
 
+// cycles executed by this hart; readable in supervisor mode
+// once start() sets mcounteren.CY.
+static inline uint64
+r_cycle()
+{
+  uint64 x;
+  asm volatile("csrr %0, cycle" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -319,6 +336,13 @@ r_ra()
   return x;
 }
 
+// wait for an interrupt.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 // flush the TLB.
 static inline void
 sfence_vma()
@@ -338,11 +362,18 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+// a megapage is mapped by a level-1 leaf PTE.
+#define MPGORDER 9 // 2^9 pages per megapage
+#define MPGSIZE (PGSIZE << MPGORDER) // 2 MB
+#define MPGROUNDDOWN(a) (((a)) & ~(MPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_COW (1L << 8) // RSW: copy-on-write page shared after fork
+#define PTE_SHARED (1L << 9) // RSW: MAP_SHARED page, stays writable after fork
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -0,0 +1,267 @@
+// Slab allocator for small kernel objects.
+//
+// A cache hands out objects of one size. Objects live in
+// slabs: single pages from kalloc(), each starting with a
+// struct slab header and holding as many objects as fit.
+// A constructor, if given, runs once when a slab is made,
+// and objects go back to the cache in their constructed
+// state, so the constructor is not rerun for each allocation.
+//
+// kmalloc() and kmfree() serve general requests of up to
+// a page from a set of power-of-two sized caches.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "slab.h"
+#include "defs.h"
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;   // cache's partial list
+  struct slab *prev;
+  void *free;          // free objects in this slab
+  int inuse;           // objects handed out
+};
+
+// Free objects are linked through a word at the start of the
+// object, or just past its end if a constructor's state must
+// be kept intact.
+#define LINK(c, obj) (*(void**)((char*)(obj) + ((c)->ctor ? (c)->size - sizeof(void*) : 0)))
+
+#define KMALLOC_MIN 16
+#define NKMALLOC 8   // 16 .. 2048 bytes
+
+static struct kmem_cache kmalloc_caches[NKMALLOC];
+static char *kmalloc_names[NKMALLOC] = {
+  "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+  "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static struct spinlock cacheslock;
+static struct kmem_cache *caches;
+
+// Set up cache c for objects of size bytes.
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size, void (*ctor)(void*))
+{
+  initlock(&c->lock, "kmem_cache");
+  c->name = name;
+  c->ctor = ctor;
+  if(size < sizeof(void*))
+    size = sizeof(void*);
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  if(ctor)
+    size += sizeof(void*);
+  c->size = size;
+  c->objoff = (sizeof(struct slab) + 15) & ~15;
+  if(c->objoff + size > PGSIZE)
+    panic("kmem_cache_init: object too large");
+  c->nobj = (PGSIZE - c->objoff) / size;
+  c->partial = 0;
+  c->nempty = 0;
+  c->nslab = 0;
+  for(int i = 0; i < NCPU; i++)
+    c->cpu[i].n = 0;
+
+  acquire(&cacheslock);
+  c->next = caches;
+  caches = c;
+  release(&cacheslock);
+}
+
+void
+kmallocinit(void)
+{
+  initlock(&cacheslock, "caches");
+  for(int i = 0; i < NKMALLOC; i++)
+    kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], KMALLOC_MIN << i, 0);
+}
+
+static void
+slab_link(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(s->next)
+    s->next->prev = s;
+  c->partial = s;
+}
+
+static void
+slab_unlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Make a new slab for cache c and put it on the partial list.
+// Caller must hold c->lock.
+static int
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return -1;
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  for(int i = c->nobj - 1; i >= 0; i--){
+    obj = (char*)s + c->objoff + i * c->size;
+    if(c->ctor)
+      c->ctor(obj);
+    LINK(c, obj) = s->free;
+    s->free = obj;
+  }
+  slab_link(c, s);
+  c->nempty++;
+  c->nslab++;
+  return 0;
+}
+
+// Take up to n objects from c's slabs, into objs.
+// Returns the number taken.
+// Caller must hold c->lock.
+static int
+slab_take(struct kmem_cache *c, void **objs, int n)
+{
+  struct slab *s;
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(c->partial == 0 && slab_grow(c) < 0)
+      break;
+    s = c->partial;
+    objs[i] = s->free;
+    s->free = LINK(c, s->free);
+    if(s->inuse++ == 0)
+      c->nempty--;
+    if(s->free == 0)
+      slab_unlink(c, s);
+  }
+  return i;
+}
+
+// Return obj to its slab. A slab that becomes empty is
+// given back to kalloc, unless the cache has no other empty
+// slab to fall back on.
+// Caller must hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  if(s->cache != c)
+    panic("slab_put");
+  if(s->free == 0)
+    slab_link(c, s);
+  LINK(c, obj) = s->free;
+  s->free = obj;
+  if(--s->inuse == 0){
+    if(c->nempty > 0){
+      slab_unlink(c, s);
+      c->nslab--;
+      kfree((void*)s);
+    } else
+      c->nempty++;
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  void *obj = 0;
+
+  push_off();
+  int id = cpuid();
+  if(c->cpu[id].n == 0){
+    acquire(&c->lock);
+    c->cpu[id].n = slab_take(c, c->cpu[id].obj, SLABMAG / 2);
+    release(&c->lock);
+  }
+  if(c->cpu[id].n > 0)
+    obj = c->cpu[id].obj[--c->cpu[id].n];
+  pop_off();
+  return obj;
+}
+
+// Give obj back to cache c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  push_off();
+  int id = cpuid();
+  if(c->cpu[id].n == SLABMAG){
+    acquire(&c->lock);
+    for(int i = SLABMAG / 2; i < SLABMAG; i++)
+      slab_put(c, c->cpu[id].obj[i]);
+    release(&c->lock);
+    c->cpu[id].n = SLABMAG / 2;
+  }
+  c->cpu[id].obj[c->cpu[id].n++] = obj;
+  pop_off();
+}
+
+// Give obj straight back to its slab rather than to this cpu's
+// free objects, so that a slab it empties can go back to
+// kalloc() now, e.g. when memory is short.
+void
+kmem_cache_release(struct kmem_cache *c, void *obj)
+{
+  acquire(&c->lock);
+  slab_put(c, obj);
+  release(&c->lock);
+}
+
+// Allocate n bytes of kernel memory, n <= PGSIZE.
+// Returns 0 if the memory cannot be allocated.
+void *
+kmalloc(uint n)
+{
+  if(n > PGSIZE)
+    panic("kmalloc");
+  for(int i = 0; i < NKMALLOC; i++){
+    if(n <= kmalloc_caches[i].size)
+      return kmem_cache_alloc(&kmalloc_caches[i]);
+  }
+  return kalloc();
+}
+
+// Free memory from kmalloc(). Slab objects are never
+// page-aligned, so a page-aligned pointer is a whole page.
+void
+kmfree(void *p)
+{
+  if((uint64)p % PGSIZE == 0){
+    kfree(p);
+    return;
+  }
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)p);
+  kmem_cache_free(s->cache, p);
+}
+
+// Print slab usage. For debugging.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kmemdump(void)
+{
+  struct kmem_cache *c;
+
+  for(c = caches; c; c = c->next){
+    if(c->nslab == 0)
+      continue;
+    printf("%s: size %d slabs %d empty %d\n",
+           c->name, c->size, c->nslab, c->nempty);
+  }
+}
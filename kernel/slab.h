@@ -0,0 +1,28 @@
+// Object caches for small kernel objects.
+// Objects are carved out of whole pages ("slabs"); each cpu
+// keeps a few free objects of its own to hand out without locking.
+
+#define SLABMAG 16   // free objects cached per cpu
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;          // Name of cache (debugging)
+  uint size;           // Size of each object, including any link
+  uint objoff;         // Offset of the first object in a slab
+  uint nobj;           // Objects per slab
+  void (*ctor)(void*); // Constructor, or 0
+
+  // lock must be held when using these:
+  struct slab *partial; // Slabs with free objects
+  int nempty;           // Slabs with no objects in use
+  int nslab;            // Slabs allocated
+
+  // Per-cpu free objects; only used by their own cpu,
+  // with interrupts off.
+  struct {
+    int n;
+    void *obj[SLABMAG];
+  } cpu[NCPU];
+
+  struct kmem_cache *next; // All caches, for kmemdump
+};
@@ -108,3 +108,16 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Can the current process sleep here, i.e. is this cpu
+// holding no spin locks?
+int
+cansleep(void)
+{
+  int r;
+
+  push_off();
+  r = (mycpu()->noff == 1);
+  pop_off();
+  return r;
+}
@@ -11,7 +11,7 @@ void timerinit();
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
 // a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+uint64 timer_scratch[NCPU][7];
 
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
@@ -43,6 +43,11 @@ start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  // let supervisor mode read the cycle counter, for membench,
+  // and user mode the time, for benchmarks like readbench.
+  w_mcounteren(r_mcounteren() | 1 | 2);
+  w_scounteren(2);
+
   // ask for clock interrupts.
   timerinit();
 
@@ -73,9 +78,13 @@ timerinit()
   // scratch[0..2] : space for timervec to save registers.
   // scratch[3] : address of CLINT MTIMECMP register.
   // scratch[4] : desired interval (in cycles) between timer interrupts.
+  // scratch[5] : set by timervec when a timer tick is pending.
+  // scratch[6] : address of CLINT MSIP register, for IPIs.
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
   scratch[4] = interval;
+  scratch[5] = 0;
+  scratch[6] = CLINT_MSIP(id);
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -84,6 +93,15 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // enable machine-mode timer and software interrupts.
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
+}
+
+// called by devintr() for a supervisor software interrupt.
+// returns 1 if timervec raised it for a clock tick, 0 if
+// it was only an IPI from another hart.
+int
+timertick()
+{
+  return __sync_lock_test_and_set(&timer_scratch[cpuid()][5], 0) != 0;
 }
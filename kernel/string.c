@@ -1,13 +1,35 @@
 #include "types.h"
 
+// memset(), memmove() and memcmp() go a word at a time, four
+// words per loop, where the alignment allows; they are behind
+// kalloc_zeroed(), the log, pipes, copyin() and copyout().
+// Only the unaligned head and tail are done byte by byte.
+// kernel/membench.c measures them.
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  char *d = (char *) dst;
+  uword w;
+
+  for(; n > 0 && ((uint64)d & 7); n--)
+    *d++ = c;
+
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(; n >= 32; n -= 32, d += 32){
+    ((uword *)d)[0] = w;
+    ((uword *)d)[1] = w;
+    ((uword *)d)[2] = w;
+    ((uword *)d)[3] = w;
   }
+  for(; n >= 8; n -= 8, d += 8)
+    *(uword *)d = w;
+
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -18,6 +40,15 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if((((uint64)s1 ^ (uint64)s2) & 7) == 0){
+    for(; n > 0 && ((uint64)s1 & 7); n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    // skip equal words; the bytes below find the difference.
+    for(; n >= 8; n -= 8, s1 += 8, s2 += 8)
+      if(*(const uword *)s1 != *(const uword *)s2)
+        break;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -39,13 +70,44 @@ memmove(void *dst, const void *src, uint n)
   s = src;
   d = dst;
   if(s < d && s + n > d){
+    // overlapping, with dst above src: copy backwards.
     s += n;
     d += n;
+    if((((uint64)s ^ (uint64)d) & 7) == 0){
+      for(; n > 0 && ((uint64)d & 7); n--)
+        *--d = *--s;
+      for(; n >= 32; n -= 32){
+        d -= 32;
+        s -= 32;
+        ((uword *)d)[3] = ((const uword *)s)[3];
+        ((uword *)d)[2] = ((const uword *)s)[2];
+        ((uword *)d)[1] = ((const uword *)s)[1];
+        ((uword *)d)[0] = ((const uword *)s)[0];
+      }
+      for(; n >= 8; n -= 8){
+        d -= 8;
+        s -= 8;
+        *(uword *)d = *(const uword *)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if((((uint64)s ^ (uint64)d) & 7) == 0){
+      for(; n > 0 && ((uint64)d & 7); n--)
+        *d++ = *s++;
+      for(; n >= 32; n -= 32, d += 32, s += 32){
+        ((uword *)d)[0] = ((const uword *)s)[0];
+        ((uword *)d)[1] = ((const uword *)s)[1];
+        ((uword *)d)[2] = ((const uword *)s)[2];
+        ((uword *)d)[3] = ((const uword *)s)[3];
+      }
+      for(; n >= 8; n -= 8, d += 8, s += 8)
+        *(uword *)d = *(const uword *)s;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
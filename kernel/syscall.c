@@ -11,10 +11,11 @@
 int
 fetchaddr(uint64 addr, uint64 *ip) {
 	struct proc *p = myproc();
-	if (addr >= *(p->sz) ||
-		addr + sizeof(uint64) > *(p->sz)) // both tests needed, in case of overflow
+	if ((addr >= p->mm->sz ||
+		 addr + sizeof(uint64) > p->mm->sz) && // both tests needed, in case of overflow
+		(addr < TSTACKBASE || addr + sizeof(uint64) > TSTACKTOP)) // or on a thread stack
 		return -1;
-	if (copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
+	if (copyin(p->mm->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
 		return -1;
 	return 0;
 }
@@ -24,7 +25,7 @@ fetchaddr(uint64 addr, uint64 *ip) {
 int
 fetchstr(uint64 addr, char *buf, int max) {
 	struct proc *p = myproc();
-	if (copyinstr(p->pagetable, buf, addr, max) < 0)
+	if (copyinstr(p->mm->pagetable, buf, addr, max) < 0)
 		return -1;
 	return strlen(buf);
 }
@@ -122,8 +123,16 @@ extern uint64 sys_close(void);
 extern uint64 sys_tfork(void); // thread fork
 extern uint64 sys_twait(void); // thread wait
 extern uint64 sys_texit(void); // thread exit
+extern uint64 sys_futex_wait(void); // block on a user address
+extern uint64 sys_futex_wake(void); // wake threads blocked on it
 ///////////////////////////////////
 
+extern uint64 sys_mmap(void);
+
+extern uint64 sys_munmap(void);
+
+extern uint64 sys_spawn(void);
+
 
 
 // An array mapping syscall numbers from syscall.h
@@ -155,7 +164,12 @@ static uint64 (*syscalls[])(void) = {
 		[SYS_tfork]   sys_tfork,
 		[SYS_twait]   sys_twait,
 		[SYS_texit]   sys_texit,
+		[SYS_futex_wait] sys_futex_wait,
+		[SYS_futex_wake] sys_futex_wake,
 ///////////////////////////////////
+		[SYS_mmap]    sys_mmap,
+		[SYS_munmap]  sys_munmap,
+		[SYS_spawn]   sys_spawn,
 };
 
 void
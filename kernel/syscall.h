@@ -25,4 +25,9 @@
 #define SYS_tfork  22
 #define SYS_twait  23
 #define SYS_texit  24
-///////////////////////////////////
\ No newline at end of file
+#define SYS_futex_wait 25
+#define SYS_futex_wake 26
+///////////////////////////////////
+#define SYS_mmap   27
+#define SYS_munmap 28
+#define SYS_spawn  29
\ No newline at end of file
@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "vma.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -24,7 +25,7 @@ argfd(int n, int *pfd, struct file **pf) {
 	struct file *f;
 
 	argint(n, &fd);
-	if (fd < 0 || fd >= NOFILE || (f = *(myproc()->ofile[fd])) == 0)
+	if (fd < 0 || fd >= NOFILE || (f = myproc()->files->ofile[fd]) == 0)
 		return -1;
 	if (pfd)
 		*pfd = fd;
@@ -41,8 +42,8 @@ fdalloc(struct file *f) {
 	struct proc *p = myproc();
 
 	for (fd = 0; fd < NOFILE; fd++) {
-		if (*(p->ofile[fd]) == 0) {
-			*(p->ofile[fd]) = f;
+		if (p->files->ofile[fd] == 0) {
+			p->files->ofile[fd] = f;
 			return fd;
 		}
 	}
@@ -96,7 +97,7 @@ sys_close(void) {
 
 	if (argfd(0, &fd, &f) < 0)
 		return -1;
-	*(myproc()->ofile[fd]) = 0;
+	myproc()->files->ofile[fd] = 0;
 	fileclose(f);
 	return 0;
 }
@@ -182,6 +183,7 @@ sys_unlink(void) {
 	struct dirent de;
 	char name[DIRSIZ], path[MAXPATH];
 	uint off;
+	int gone;
 
 	if (argstr(0, path, MAXPATH) < 0)
 		return -1;
@@ -220,7 +222,12 @@ sys_unlink(void) {
 
 	ip->nlink--;
 	iupdate(ip);
-	iunlockput(ip);
+	gone = (ip->nlink == 0);
+	iunlock(ip);
+	// exec() may be holding on to it; let its blocks go.
+	if (gone)
+		pcache_unhold(ip);
+	iput(ip);
 
 	end_op();
 
@@ -410,52 +417,86 @@ sys_chdir(void) {
 		return -1;
 	}
 	iunlock(ip);
-	iput(*(p->cwd));
+	iput(p->files->cwd);
 	end_op();
-	*(p->cwd) = ip;
+	p->files->cwd = ip;
 	return 0;
 }
 
-uint64
-sys_exec(void) {
-	char path[MAXPATH], *argv[MAXARG];
+// Copy the user argv array at uargv, and the strings it points
+// to, into argv. The strings go in pages from kalloc(), which
+// the caller frees with freeargv(), failure or not.
+static int
+fetchargv(uint64 uargv, char **argv) {
 	int i;
-	uint64 uargv, uarg;
+	uint64 uarg;
 
-	argaddr(1, &uargv);
-	if (argstr(0, path, MAXPATH) < 0) {
-		return -1;
-	}
-	memset(argv, 0, sizeof(argv));
+	memset(argv, 0, sizeof(char *) * MAXARG);
 	for (i = 0;; i++) {
-		if (i >= NELEM(argv)) {
-			goto bad;
-		}
-		if (fetchaddr(uargv + sizeof(uint64) * i, (uint64 *)&uarg) < 0) {
-			goto bad;
-		}
+		if (i >= MAXARG)
+			return -1;
+		if (fetchaddr(uargv + sizeof(uint64) * i, (uint64 *)&uarg) < 0)
+			return -1;
 		if (uarg == 0) {
 			argv[i] = 0;
-			break;
+			return 0;
 		}
 		argv[i] = kalloc();
 		if (argv[i] == 0)
-			goto bad;
+			return -1;
 		if (fetchstr(uarg, argv[i], PGSIZE) < 0)
-			goto bad;
+			return -1;
 	}
+}
 
-	int ret = exec(path, argv);
+static void
+freeargv(char **argv) {
+	int i;
 
-	for (i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+	for (i = 0; i < MAXARG && argv[i] != 0; i++)
 		kfree(argv[i]);
+}
+
+uint64
+sys_exec(void) {
+	char path[MAXPATH], *argv[MAXARG];
+	uint64 uargv;
+	int ret = -1;
 
+	argaddr(1, &uargv);
+	if (argstr(0, path, MAXPATH) < 0) {
+		return -1;
+	}
+	if (fetchargv(uargv, argv) == 0)
+		ret = exec(myproc(), path, argv);
+	freeargv(argv);
 	return ret;
+}
 
-	bad:
-	for (i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-		kfree(argv[i]);
-	return -1;
+uint64
+sys_spawn(void) {
+	char path[MAXPATH], *argv[MAXARG];
+	int i, fdmap[NOFILE];
+	uint64 uargv, ufdmap;
+	int ret = -1;
+	struct proc *p = myproc();
+
+	argaddr(1, &uargv);
+	argaddr(2, &ufdmap);
+	if (argstr(0, path, MAXPATH) < 0)
+		return -1;
+	if (ufdmap) {
+		if (copyin(p->mm->pagetable, (char *)fdmap, ufdmap, sizeof(fdmap)) < 0)
+			return -1;
+		// A descriptor that is not open maps to a closed one.
+		for (i = 0; i < NOFILE; i++)
+			if (fdmap[i] < -1 || fdmap[i] >= NOFILE)
+				return -1;
+	}
+	if (fetchargv(uargv, argv) == 0)
+		ret = spawn(path, argv, ufdmap ? fdmap : 0);
+	freeargv(argv);
+	return ret;
 }
 
 uint64
@@ -471,18 +512,79 @@ sys_pipe(void) {
 	fd0 = -1;
 	if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0) {
 		if (fd0 >= 0)
-			*(p->ofile[fd0]) = 0;
+			p->files->ofile[fd0] = 0;
 		fileclose(rf);
 		fileclose(wf);
 		return -1;
 	}
-	if (copyout(p->pagetable, fdarray, (char *)&fd0, sizeof(fd0)) < 0 ||
-		copyout(p->pagetable, fdarray + sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0) {
-		*(p->ofile[fd0]) = 0;
-		*(p->ofile[fd1]) = 0;
+	if (copyout(p->mm->pagetable, fdarray, (char *)&fd0, sizeof(fd0)) < 0 ||
+		copyout(p->mm->pagetable, fdarray + sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0) {
+		p->files->ofile[fd0] = 0;
+		p->files->ofile[fd1] = 0;
 		fileclose(rf);
 		fileclose(wf);
 		return -1;
 	}
 	return 0;
 }
+
+// Map a file, or anonymous memory with MAP_ANONYMOUS, at an
+// address of the kernel's choosing; addr is ignored.
+// Pages are filled in when they are first touched.
+uint64
+sys_mmap(void) {
+	uint64 len;
+	int prot, flags, off, perm, vflags;
+	struct file *f;
+	struct inode *ip = 0;
+
+	argaddr(1, &len);
+	argint(2, &prot);
+	argint(3, &flags);
+	argint(5, &off);
+
+	if (len == 0 || len > MAXVA)
+		return -1;
+	if (((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+		return -1; // need exactly one of them
+	vflags = (flags & MAP_SHARED) ? VMA_SHARED : 0;
+
+	perm = PTE_U;
+	if (prot & PROT_READ)
+		perm |= PTE_R;
+	if (prot & PROT_WRITE)
+		perm |= PTE_R | PTE_W; // write-only is not a valid PTE
+	if (prot & PROT_EXEC)
+		perm |= PTE_X;
+
+	if ((flags & MAP_ANONYMOUS) == 0) {
+		if (argfd(4, 0, &f) < 0)
+			return -1;
+		if (f->type != FD_INODE || f->ip->type != T_FILE)
+			return -1;
+		if (off < 0 || off % PGSIZE != 0)
+			return -1;
+		if (!f->readable)
+			return -1;
+		if ((vflags & VMA_SHARED) && (prot & PROT_WRITE) && !f->writable)
+			return -1;
+		ip = f->ip;
+	}
+
+	return vma_mmap(myproc()->mm, len, perm, vflags, ip, off);
+}
+
+// Unmap the pages of [addr, addr+len); MAP_SHARED pages that
+// were written go back to their file.
+uint64
+sys_munmap(void) {
+	uint64 addr, len;
+
+	argaddr(0, &addr);
+	argaddr(1, &len);
+	if (addr % PGSIZE != 0 || len == 0)
+		return -1;
+	if (addr + len < addr || addr + len > MAXVA)
+		return -1;
+	return vma_munmap(myproc()->mm, addr, PGROUNDUP(addr + len));
+}
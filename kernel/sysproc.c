@@ -41,7 +41,7 @@ sys_sbrk(void) {
 	int n;
 
 	argint(0, &n);
-	addr = *(myproc()->sz);
+	addr = myproc()->mm->sz;
 	if (growproc(n) < 0)
 		return -1;
 	return addr;
@@ -103,19 +103,43 @@ uint64
 sys_twait(void) {
 
 	thread_t t;
-	argaddr(0, (void *)&t);
+	uint64 ret;
+	argint(0, &t);
+	argaddr(1, &ret);
 
-	return twait(t, 0);
+	return twait(t, ret);
 }
 
 uint64
 sys_texit(void) {
 
-	void *ret;
-	argaddr(0, (void *)&ret);
+	uint64 ret;
+	argaddr(0, &ret);
 
 	texit(ret);
-	return 0;
+	return 0;  // not reached
+}
+
+uint64
+sys_futex_wait(void) {
+	uint64 addr;
+	int val;
+
+	argaddr(0, &addr);
+	argint(1, &val);
+
+	return futex_wait(addr, val);
+}
+
+uint64
+sys_futex_wake(void) {
+	uint64 addr;
+	int n;
+
+	argaddr(0, &addr);
+	argint(1, &n);
+
+	return futex_wake(addr, n);
 }
 
 ///////////////////////////////////
@@ -45,6 +45,11 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  // no longer running on the user page table; see tlbshootdown().
+  struct cpu *c = mycpu();
+  __atomic_store_n(&c->upagetable, 0, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&c->ntrap, 1, __ATOMIC_RELEASE);
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -67,6 +72,19 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault, e.g. a write to a copy-on-write page, or the
+    // first touch of a page that must be read from a file.
+    uint64 scause = r_scause(), stval = r_stval();
+
+    // reading the file sleeps; done with the trap registers.
+    intr_on();
+
+    if(pagefault(p->mm->pagetable, stval, scause == 15) < 0){
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, stval);
+      setkilled(p);
+    }
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -120,7 +138,11 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->mm->pagetable);
+
+  // from here on this cpu may cache p's user mappings.
+  __atomic_store_n(&mycpu()->upagetable, p->mm->pagetable, __ATOMIC_RELEASE);
+  __sync_synchronize();
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -202,16 +224,22 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
+
+    // acknowledge the software interrupt by clearing
+    // the SSIP bit in sip. do this before timertick(), so
+    // that a tick arriving in between raises it again.
+    w_sip(r_sip() & ~2);
+
+    // an IPI only needs to wake this hart from wfi;
+    // the scheduler will find the new work itself.
+    if(!timertick())
+      return 1;
 
     if(cpuid() == 0){
       clockintr();
     }
-    
-    // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
 
     return 2;
   } else {
@@ -8,3 +8,7 @@ typedef unsigned int  uint32;
 typedef unsigned long uint64;
 
 typedef uint64 pde_t;
+
+// A machine word that may alias any other type, for copying
+// memory a word at a time.
+typedef uint64 __attribute__((__may_alias__)) uword;
@@ -29,6 +29,10 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration
+
+// virtio_blk_config fields, as offsets from VIRTIO_MMIO_CONFIG
+#define VIRTIO_BLK_CONFIG_SEG_MAX	0x00c // most data segments per request
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -37,6 +41,7 @@
 #define VIRTIO_CONFIG_S_FEATURES_OK	8
 
 // device feature bits
+#define VIRTIO_BLK_F_SEG_MAX         2	/* seg_max in config is valid */
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
@@ -45,9 +50,11 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// at most this many virtio descriptors, fewer if the device
+// wants a smaller queue. must be a power of two, and no more
+// than 256, so that desc, avail and used each fit in a page.
+// 128 leaves room for a request of NSEG blocks.
+#define NUM 128
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -58,6 +65,7 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
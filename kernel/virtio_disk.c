@@ -19,10 +19,27 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// Bufs for consecutive blocks that are queued one after the other
+// for the same direction go to the device as one request, with a
+// data descriptor for each buf.
+#define NSEG 64     // most blocks in one request
+#define NPEND 16    // requests queued before they must go in the ring
+
+#define TBLSIZE ((NSEG + 2) * sizeof(struct virtq_desc))
+#define TBLPERPG (PGSIZE / TBLSIZE)
+
+// A request that has not been put in the avail ring yet.
+struct vreq {
+  struct buf *b;     // first buf; the rest follow through qnext
+  struct buf *last;
+  int n;             // bufs
+  int write;
+};
+
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
-  // disk operations. there are NUM descriptors.
+  // disk operations. there are qsize descriptors.
   // most commands consist of a "chain" (a linked list) of a couple of
   // these descriptors.
   struct virtq_desc *desc;
@@ -30,26 +47,40 @@ static struct disk {
   // a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // qsize elements.
   struct virtq_avail *avail;
 
   // a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are qsize used ring entries.
   struct virtq_used *used;
 
   // our own book-keeping.
+  int qsize;       // queue size agreed with the device, <= NUM
+  int maxseg;      // most blocks in one request
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
+  // indirect descriptor tables, one per head descriptor, if
+  // the device supports them.
+  int useindirect;
+  struct virtq_desc *indirect[NUM];
+
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;   // the request's bufs, through qnext
     char status;
   } info[NUM];
 
+  // requests virtio_disk_start() has queued but not put in the
+  // avail ring, and requests in the avail ring that the device
+  // has not been told about yet; see flush().
+  struct vreq pend[NPEND];
+  int npend;
+  int unkicked;
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
@@ -91,7 +122,7 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // keep VIRTIO_RING_F_INDIRECT_DESC if the device offers it.
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
@@ -114,7 +145,10 @@ virtio_disk_init(void)
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  disk.qsize = NUM;
+  while(disk.qsize > max)
+    disk.qsize /= 2;
+  if(disk.qsize < 4)
     panic("virtio disk max queue too short");
 
   // allocate and zero queue memory.
@@ -128,7 +162,7 @@ virtio_disk_init(void)
   memset(disk.used, 0, PGSIZE);
 
   // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.qsize;
 
   // write physical addresses.
   *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
@@ -141,10 +175,36 @@ virtio_disk_init(void)
   // queue is ready.
   *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
+  // all descriptors start out unused.
+  for(int i = 0; i < disk.qsize; i++)
     disk.free[i] = 1;
 
+  // with indirect descriptors, each request's descriptors go in a
+  // table of its own, and it takes one from disk.desc; without,
+  // requests must be small enough for two to fit. Either way a
+  // request's header, data and status descriptors must number
+  // no more than the queue size, and the device may want fewer
+  // data segments still.
+  if(features & (1 << VIRTIO_RING_F_INDIRECT_DESC)){
+    char *pg = 0;
+    for(int i = 0; i < disk.qsize; i++){
+      if(i % TBLPERPG == 0 && (pg = kalloc()) == 0)
+        panic("virtio disk kalloc");
+      disk.indirect[i] = (struct virtq_desc *)(pg + (i % TBLPERPG) * TBLSIZE);
+    }
+    disk.useindirect = 1;
+    disk.maxseg = disk.qsize - 2;
+  } else {
+    disk.maxseg = disk.qsize / 2 - 2;
+  }
+  if(disk.maxseg > NSEG)
+    disk.maxseg = NSEG;
+  if(features & (1 << VIRTIO_BLK_F_SEG_MAX)){
+    uint32 segmax = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_SEG_MAX);
+    if(segmax > 0 && disk.maxseg > segmax)
+      disk.maxseg = segmax;
+  }
+
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
@@ -152,11 +212,23 @@ virtio_disk_init(void)
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
+// Tell the device about requests in the avail ring.
+// Caller must hold disk.vdisk_lock.
+static void
+notify(void)
+{
+  if(disk.unkicked == 0)
+    return;
+  __sync_synchronize();
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  disk.unkicked = 0;
+}
+
 // find a free descriptor, mark it non-free, return its index.
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.qsize; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
       return i;
@@ -169,7 +241,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.qsize)
     panic("free_desc 1");
   if(disk.free[i])
     panic("free_desc 2");
@@ -196,12 +268,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,88 +283,196 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// The ith descriptor of the request that has descriptors idx[],
+// or, with indirect descriptors, the table for idx[0].
+static struct virtq_desc *
+reqdesc(int *idx, int i)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  if(disk.useindirect)
+    return &disk.indirect[idx[0]][i];
+  return &disk.desc[idx[i]];
+}
 
-  acquire(&disk.vdisk_lock);
+static uint16
+reqnext(int *idx, int i)
+{
+  return disk.useindirect ? i + 1 : idx[i + 1];
+}
+
+// Put request r in the avail ring, sleeping for descriptors
+// if need be.
+// Caller must hold disk.vdisk_lock.
+static void
+submit(struct vreq *r)
+{
+  int idx[NSEG + 2];
+  int i, head, n = r->n + 2;
+  struct virtq_desc *d;
+  struct buf *b;
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, then ones for the
+  // data, then one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  // the requests holding them may not have been sent yet.
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, disk.useindirect ? 1 : n) == 0) {
       break;
     }
+    notify();
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
+  head = idx[0];
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &disk.ops[head];
 
-  if(write)
+  if(r->write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
     buf0->type = VIRTIO_BLK_T_IN; // read the disk
   buf0->reserved = 0;
-  buf0->sector = sector;
-
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  buf0->sector = r->b->blockno * (BSIZE / 512);
+
+  d = reqdesc(idx, 0);
+  d->addr = (uint64) buf0;
+  d->len = sizeof(struct virtio_blk_req);
+  d->flags = VRING_DESC_F_NEXT;
+  d->next = reqnext(idx, 0);
+
+  for(i = 1, b = r->b; b; i++, b = b->qnext){
+    d = reqdesc(idx, i);
+    d->addr = (uint64) b->data;
+    d->len = BSIZE;
+    if(r->write)
+      d->flags = 0; // device reads b->data
+    else
+      d->flags = VRING_DESC_F_WRITE; // device writes b->data
+    d->flags |= VRING_DESC_F_NEXT;
+    d->next = reqnext(idx, i);
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.info[head].status = 0xff; // device writes 0 on success
+  d = reqdesc(idx, i);
+  d->addr = (uint64) &disk.info[head].status;
+  d->len = 1;
+  d->flags = VRING_DESC_F_WRITE; // device writes the status
+  d->next = 0;
+
+  if(disk.useindirect){
+    disk.desc[head].addr = (uint64) disk.indirect[head];
+    disk.desc[head].len = n * sizeof(struct virtq_desc);
+    disk.desc[head].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[head].next = 0;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the bufs for virtio_disk_intr().
+  disk.info[head].b = r->b;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % disk.qsize] = head;
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
+  disk.unkicked++;
+}
 
-  __sync_synchronize();
+// Put the queued requests in the avail ring and tell the device.
+// Caller must hold disk.vdisk_lock.
+static void
+flush(void)
+{
+  struct vreq r;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  while(disk.npend > 0){
+    r = disk.pend[0];
+    disk.npend--;
+    memmove(&disk.pend[0], &disk.pend[1], disk.npend * sizeof(r));
+    submit(&r);
+  }
+  notify();
+}
+
+// Queue a request to read or write b, but leave it to
+// virtio_disk_kick() or virtio_disk_wait() to send it, so that
+// requests for consecutive blocks can be merged and a batch of
+// requests costs one doorbell write.
+// When the request is done virtio_disk_intr() calls b->done(b),
+// if it is set, or else wakes up virtio_disk_wait().
+void
+virtio_disk_start(struct buf *b, int write)
+{
+  struct vreq *r;
+
+  acquire(&disk.vdisk_lock);
+
+  b->disk = 1;
+  b->qnext = 0;
+
+  // the next block after the last queued request's?
+  r = disk.npend > 0 ? &disk.pend[disk.npend - 1] : 0;
+  if(r && r->write == write && r->n < disk.maxseg &&
+     r->last->dev == b->dev && r->last->blockno + 1 == b->blockno){
+    r->last->qnext = b;
+    r->last = b;
+    r->n++;
+  } else {
+    if(disk.npend == NPEND)
+      flush();
+    r = &disk.pend[disk.npend++];
+    r->b = r->last = b;
+    r->n = 1;
+    r->write = write;
+  }
+
+  release(&disk.vdisk_lock);
+}
+
+// Send the device the requests virtio_disk_start() has queued.
+void
+virtio_disk_kick(void)
+{
+  if(__atomic_load_n(&disk.npend, __ATOMIC_RELAXED) == 0 &&
+     __atomic_load_n(&disk.unkicked, __ATOMIC_RELAXED) == 0)
+    return;
+  acquire(&disk.vdisk_lock);
+  flush();
+  release(&disk.vdisk_lock);
+}
+
+// Wait for the request for b, which has no done function,
+// to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  flush();
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
+  struct buf *done = 0, *b, *nb;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -311,17 +490,32 @@ virtio_disk_intr()
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = disk.used->ring[disk.used_idx % disk.qsize].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    for(b = disk.info[id].b; b; b = nb){
+      nb = b->qnext;
+      b->disk = 0;   // disk is done with buf
+      if(b->done){
+        b->qnext = done;
+        done = b;
+      } else
+        wakeup(b);
+    }
+    disk.info[id].b = 0;
+    free_chain(id);
 
     disk.used_idx += 1;
   }
 
   release(&disk.vdisk_lock);
+
+  // done functions may take buffer cache locks, so call
+  // them without the disk lock.
+  for(b = done; b; b = nb){
+    nb = b->qnext;
+    b->done(b);
+  }
 }
@@ -15,6 +15,12 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static pte_t *walklevel(pagetable_t, uint64, int, int *);
+static pte_t *megapte(pagetable_t, uint64);
+
+// Does word w have a zero byte?
+#define HASZERO(w) (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -30,6 +36,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for sending inter-processor interrupts
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -82,26 +91,51 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va is in a megapage, returns its level-1 leaf PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level;
+
+  return walklevel(pagetable, va, alloc, &level);
+}
+
+// Like walk(), and set *level to the level of the PTE:
+// 1 for a megapage, 0 otherwise.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(*level = 2; *level > 0; (*level)--) {
+    pte_t *pte = &pagetable[PX(*level, va)];
+    if((*pte & PTE_V) && (*pte & (PTE_R|PTE_W|PTE_X)))
+      return pte; // megapage
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// The physical address of the page containing va, which the
+// level-level leaf PTE pte maps.
+static uint64
+pteaddr(pte_t pte, int level, uint64 va)
+{
+  uint64 pa = PTE2PA(pte);
+
+  if(level == 1)
+    pa += PGROUNDDOWN(va) & (MPGSIZE - 1);
+  return pa;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -109,20 +143,78 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
-  return pa;
+  return pteaddr(*pte, level, va);
+}
+
+// Look up user virtual address va for a read, or a write if
+// write is set, and return the physical address. Faults the
+// page in first if the access would fault in user mode, e.g.
+// a write to a copy-on-write page. Sets *n to the number of
+// bytes from va to the end of the page, or megapage, so that
+// the copy routines walk once per leaf. Returns 0 if the
+// access is not allowed.
+static uint64
+uaddr(pagetable_t pagetable, uint64 va, int write, uint64 *n)
+{
+  pte_t *pte;
+  uint64 need = PTE_V | PTE_U | (write ? PTE_W : 0);
+  uint64 size;
+  int level;
+
+  if(va >= MAXVA)
+    return 0;
+
+  for(;;){
+    pte = walklevel(pagetable, va, 0, &level);
+    if(pte && (*pte & need) == need){
+      size = level == 1 ? MPGSIZE : PGSIZE;
+      *n = size - (va & (size - 1));
+      return pteaddr(*pte, level, va) + (va & (PGSIZE - 1));
+    }
+    if(pagefault(pagetable, va, write) < 0)
+      return 0;
+  }
+}
+
+// Like uaddr(), for one page.
+uint64
+walkuaddr(pagetable_t pagetable, uint64 va, int write)
+{
+  uint64 n;
+
+  return uaddr(pagetable, va, write, &n);
+}
+
+// Fault in the user pages of [va, va+len) for a read, or a
+// write if write is set, e.g. before taking a lock that a
+// fault on them would need. Returns 0, or -1 if some page
+// cannot be accessed.
+int
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  uint64 n;
+
+  while(len > 0){
+    if(uaddr(pagetable, va, write, &n) == 0)
+      return -1;
+    if(n > len)
+      n = len;
+    len -= n;
+    va += n;
+  }
+  return 0;
 }
 
 // add a mapping to the kernel page table.
@@ -164,25 +256,44 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Drop the mapping's reference to each page of the megapage
+// at pa; see uvmmapmega().
+static void
+megafree(uint64 pa)
+{
+  for(int i = 0; i < 512; i++)
+    kfree((void*)(pa + (uint64)i * PGSIZE));
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched, and so are
+// not mapped, are skipped. Megapages must lie wholly inside
+// the range; see uvmsplit().
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end = va + npages*PGSIZE;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level == 1){
+      if(a % MPGSIZE != 0 || a + MPGSIZE > end)
+        panic("uvmunmap: part of a megapage");
+      if(do_free)
+        megafree(PTE2PA(*pte));
+      *pte = 0;
+      a += MPGSIZE - PGSIZE;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
@@ -197,10 +308,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -214,8 +324,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
   memmove(mem, src, sz);
@@ -234,12 +343,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -297,42 +405,274 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share the memory
+// from va to end with a child's page table, copy-on-write.
+// Writable pages become read-only PTE_COW pages in both,
+// and are copied by uvmcow() when either side writes,
+// except PTE_SHARED ones, which both go on writing.
+// Megapages that lie wholly in the range are shared whole.
+// The caller must flush other harts' TLBs for old.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 va, uint64 end)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  int level;
+
+  for(i = va; i < end; i += PGSIZE){
+    if((pte = walklevel(old, i, 0, &level)) == 0 || (*pte & PTE_V) == 0)
+      continue; // lazily allocated, and not touched yet
+    if(level == 1 && (i % MPGSIZE != 0 || i + MPGSIZE > end)){
+      // only part of this megapage is being copied.
+      if(uvmsplit(old, i) < 0)
+        goto err;
+      pte = walklevel(old, i, 0, &level);
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
+    if((flags & (PTE_W|PTE_SHARED)) == PTE_W){
+      flags = (flags & ~PTE_W) | PTE_COW;
+      *pte = PA2PTE(pa) | flags;
+    }
+    if(level == 1){
+      if((pte = megapte(new, i)) == 0)
+        goto err;
+      *pte = PA2PTE(pa) | flags;
+      for(int j = 0; j < 512; j++)
+        krefinc((void*)(pa + (uint64)j * PGSIZE));
+      i += MPGSIZE - PGSIZE;
+      continue;
     }
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
+      goto err;
+    krefinc((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// Is anything mapped at va, even if not accessible to the user?
+int
+uvmmapped(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  return pte != 0 && (*pte & PTE_V) != 0;
+}
+
+// Map a zeroed user page at va, which must not be mapped,
+// for an access to lazily allocated heap memory.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmzero(pagetable_t pagetable, uint64 va)
+{
+  char *mem;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(mappages(pagetable, PGROUNDDOWN(va), PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+static uint64
+resident(pagetable_t pagetable, int level)
+{
+  uint64 n = 0;
+
+  // there are 2^9 = 512 PTEs in a page table.
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0)
+      n += resident((pagetable_t)PTE2PA(pte), level - 1);
+    else if((pte & PTE_V) && (pte & PTE_U))
+      n += 1L << (9 * level);
+  }
+  return n;
+}
+
+// Count the user pages mapped in pagetable,
+// a megapage as the 512 pages it holds.
+uint64
+uvmresident(pagetable_t pagetable)
+{
+  return resident(pagetable, 2);
+}
+
+// The level-1 PTE for megapage-aligned va, allocating the
+// level-1 page table if need be, if nothing at all is mapped
+// in [va, va+MPGSIZE) yet. Returns 0 if something is, or if
+// out of memory.
+static pte_t *
+megapte(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(va % MPGSIZE != 0 || va + MPGSIZE > MAXVA)
+    return 0;
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V){
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  } else {
+    if((mem = kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(mem) | PTE_V;
+    pte = &((pagetable_t)mem)[PX(1, va)];
+  }
+  if(*pte & PTE_V)
+    return 0;
+  return pte;
+}
+
+// Could a megapage be mapped at va, which must be megapage
+// aligned? Not if anything in [va, va+MPGSIZE) is mapped.
+int
+uvmcanmega(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va % MPGSIZE != 0 || va + MPGSIZE > MAXVA)
+    return 0;
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0)
+    return 1;
+  return (((pagetable_t)PTE2PA(*pte))[PX(1, va)] & PTE_V) == 0;
+}
+
+// Allocate a zeroed megapage for uvmmapmega(), for a first
+// touch of a large lazily allocated region. Zeroing 2 MB takes
+// a while, so callers do it before they take mm->lock.
+// Returns 0 if there is no free megapage, in which case the
+// caller should fall back on single pages.
+char *
+uvmallocmega(void)
+{
+  char *mem;
+
+  if((mem = kalloc_order(MPGORDER)) != 0)
+    memset(mem, 0, MPGSIZE);
+  return mem;
+}
+
+// Map megapage mem, from uvmallocmega(), with permissions perm
+// at va, if nothing in [va, va+MPGSIZE) is mapped yet. Its 512
+// pages are then each counted, and freed, on their own, so that
+// the megapage can be shared copy-on-write and later split.
+// Returns 0, or -1 if mem was not used and should be freed
+// with kfree_order().
+int
+uvmmapmega(pagetable_t pagetable, uint64 va, char *mem, int perm)
+{
+  pte_t *pte;
+
+  if((pte = megapte(pagetable, va)) == 0)
+    return -1;
+  ksplit(mem, MPGORDER);
+  *pte = PA2PTE(mem) | perm | PTE_V;
+  return 0;
+}
+
+// If va is in a megapage, map the same memory with 512 PTEs
+// instead, so that part of it can be unmapped or copied.
+// Since the translation does not change, no TLB flush is
+// needed. Returns 0, or -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t l0;
+  uint64 pa;
+  int level, flags;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || level != 1)
+    return 0;
+
+  if((l0 = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  for(int i = 0; i < 512; i++)
+    l0[i] = PA2PTE(pa + (uint64)i * PGSIZE) | flags;
+  *pte = PA2PTE(l0) | PTE_V;
+  return 0;
+}
+
+// Make the copy-on-write page at va writable, copying it
+// unless this page table is its last user. Returns 0 if the
+// page is now writable, -1 if it is not a copy-on-write
+// page or there is no memory for the copy.
+// The caller must keep others from changing the mapping.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+  int level, i;
+
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walklevel(pagetable, va, 0, &level)) == 0)
+    return -1;
+  if((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+    return -1;
+  if(*pte & PTE_W)
+    return 0; // another thread got here first
+  if((*pte & PTE_COW) == 0)
+    return -1;
+
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(level == 1){
+    for(i = 0; i < 512; i++)
+      if(krefcnt((void*)(pa + (uint64)i * PGSIZE)) != 1)
+        break;
+    if(i == 512){
+      // a megapage nobody else maps any more.
+      *pte = PA2PTE(pa) | flags;
+      return 0;
+    }
+    // Still shared: copy just the page at va, rather
+    // than 2 MB. Others go on using the megapage.
+    if(uvmsplit(pagetable, va) < 0)
+      return -1;
+    pte = walk(pagetable, va, 0);
+    pa = PTE2PA(*pte);
+  }
+  if(krefcnt((void*)pa) == 1){
+    // Nobody else left to share with. Stale read-only TLB
+    // entries elsewhere just fault again and find it writable.
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+
+  // Other threads must stop reading the old page.
+  tlbshootdown(pagetable);
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -352,21 +692,19 @@ uvmclear(pagetable_t pagetable, uint64 va)
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa0;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uaddr(pagetable, dstva, 1, &n);
     if(pa0 == 0)
       return -1;
-    n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    memmove((void *)pa0, src, n);
 
     len -= n;
     src += n;
-    dstva = va0 + PGSIZE;
+    dstva += n;
   }
   return 0;
 }
@@ -377,21 +715,19 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa0;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uaddr(pagetable, srcva, 0, &n);
     if(pa0 == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    memmove(dst, (void *)pa0, n);
 
     len -= n;
     dst += n;
-    srcva = va0 + PGSIZE;
+    srcva += n;
   }
   return 0;
 }
@@ -403,19 +739,29 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa0;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uaddr(pagetable, srcva, 0, &n);
     if(pa0 == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
-
-    char *p = (char *) (pa0 + (srcva - va0));
+    srcva += n;
+
+    char *p = (char *) pa0;
+    // a word at a time while both sides are aligned and
+    // the word has no NUL in it.
+    if((((uint64)p | (uint64)dst) & 7) == 0){
+      while(n >= 8 && !HASZERO(*(uword *)p)){
+        *(uword *)dst = *(uword *)p;
+        n -= 8;
+        max -= 8;
+        p += 8;
+        dst += 8;
+      }
+    }
     while(n > 0){
       if(*p == '\0'){
         *dst = '\0';
@@ -429,8 +775,6 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
-
-    srcva = va0 + PGSIZE;
   }
   if(got_null){
     return 0;
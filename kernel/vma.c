@@ -0,0 +1,742 @@
+// File and anonymous memory mappings, and the page cache that
+// lets processes share the pages of a file.
+//
+// exec() records each loadable segment as a vma instead of
+// reading it in, and mmap() adds vmas above the heap;
+// vma_fault() fills in a page the first time it is touched.
+// If the vma's file offset is page aligned, pages lying in the
+// file come from the page cache, which keeps one copy of each
+// such page per inode, hung off ip->pages; every mapping takes
+// its own kref on the physical page, the cache holds one more.
+// Writable private mappings get the cached page copy-on-write,
+// and MAP_SHARED ones get the cached page itself, which is
+// written back to the file when such a vma goes away (munmap,
+// exit). Other pages are read into a private copy, or zero.
+//
+// Cached pages live until the inode's last reference goes
+// away (iput). writei() copies what it writes into them and
+// truncation zeroes them, so that every mapping of a file and
+// read() see the same data. To keep the pages of programs that are run over
+// and over, such as those the shell starts, the cache holds a
+// reference to the last NPCHOLD inodes passed to exec(), until
+// the file is unlinked.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "slab.h"
+#include "vma.h"
+#include "defs.h"
+
+#define NPCHOLD 8
+
+struct pcpage {
+  uint pgno;            // Page number within the file
+  char *pa;             // The page
+  int dirty;            // Mapped writable by a MAP_SHARED vma
+  struct pcpage *next;  // Next page of the same inode
+};
+
+struct {
+  struct spinlock lock; // protects every ip->pages, and hold
+  struct inode *hold[NPCHOLD]; // Recently exec'd, newest first
+} pcache;
+
+// vmas dropped where iput() could not sleep, to be freed by
+// the next vma_reap().
+struct {
+  struct spinlock lock;
+  struct vma *list;
+} vmadead;
+
+struct kmem_cache vmacache;
+struct kmem_cache pcpagecache;
+
+void
+vmainit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  initlock(&vmadead.lock, "vmadead");
+  kmem_cache_init(&vmacache, "vma", sizeof(struct vma), 0);
+  kmem_cache_init(&pcpagecache, "pcpage", sizeof(struct pcpage), 0);
+}
+
+// Add a vma to mm for va [start, end), backed by filesz bytes
+// of ip at offset off. start must be page aligned.
+// Returns 0, or -1 if out of memory.
+int
+vma_add(struct mm *mm, uint64 start, uint64 end, int perm,
+        struct inode *ip, uint off, uint filesz)
+{
+  struct vma *v, **vp;
+
+  if((v = kmem_cache_alloc(&vmacache)) == 0)
+    return -1;
+  v->start = start;
+  v->end = end;
+  v->perm = perm;
+  v->flags = 0;
+  if(off % PGSIZE == 0)
+    v->flags |= VMA_PCACHE;
+  v->ip = idup(ip);
+  v->off = off;
+  v->filesz = filesz;
+  v->next = 0;
+
+  acquire(&mm->lock);
+  for(vp = &mm->vmas; *vp; vp = &(*vp)->next)
+    ;
+  *vp = v;
+  release(&mm->lock);
+  return 0;
+}
+
+// Find the vma of mm that contains va.
+// Caller must hold mm->lock.
+struct vma *
+vma_find(struct mm *mm, uint64 va)
+{
+  struct vma *v;
+
+  for(v = mm->vmas; v; v = v->next)
+    if(va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Does any vma of mm overlap va [start, end)?
+// Caller must hold mm->lock.
+int
+vma_overlaps(struct mm *mm, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = mm->vmas; v; v = v->next)
+    if(start < v->end && v->start < end)
+      return 1;
+  return 0;
+}
+
+// Give mm a copy of the vma list v, for fork().
+// Caller must hold the lock of the mm that v belongs to.
+// Returns 0, or -1 if out of memory, leaving whatever
+// was copied on mm for mmput() to free.
+int
+vma_dup(struct mm *mm, struct vma *v)
+{
+  struct vma *nv, **vp;
+
+  for(vp = &mm->vmas; *vp; vp = &(*vp)->next)
+    ;
+  for(; v; v = v->next){
+    if((nv = kmem_cache_alloc(&vmacache)) == 0)
+      return -1;
+    *nv = *v;
+    if(v->ip)
+      nv->ip = idup(v->ip);
+    nv->next = 0;
+    *vp = nv;
+    vp = &nv->next;
+  }
+  return 0;
+}
+
+// Put a list of vmas aside for vma_reap().
+static void
+vma_park(struct vma *v)
+{
+  struct vma *last;
+
+  if(v == 0)
+    return;
+  for(last = v; last->next; last = last->next)
+    ;
+  acquire(&vmadead.lock);
+  last->next = vmadead.list;
+  vmadead.list = v;
+  release(&vmadead.lock);
+}
+
+static void pcache_flush(struct inode *);
+
+// Free a list of vmas that is no longer part of any mm,
+// writing back what MAP_SHARED vmas wrote to their files.
+// That and iput() may have to write the disk, so if the caller
+// holds a spin lock (freeproc() does) the list is put aside
+// for vma_reap(). Must not be called inside a transaction.
+void
+vma_freelist(struct vma *v)
+{
+  struct vma *next;
+
+  if(!cansleep()){
+    vma_park(v);
+    return;
+  }
+
+  for(; v; v = next){
+    next = v->next;
+    if(v->ip){
+      if((v->flags & VMA_SHARED) && (v->perm & PTE_W))
+        pcache_flush(v->ip);
+      begin_op();
+      iput(v->ip);
+      end_op();
+    }
+    kmem_cache_free(&vmacache, v);
+  }
+}
+
+// Free the vmas vma_freelist() had to put aside.
+void
+vma_reap(void)
+{
+  struct vma *v;
+
+  acquire(&vmadead.lock);
+  v = vmadead.list;
+  vmadead.list = 0;
+  release(&vmadead.lock);
+  vma_freelist(v);
+}
+
+// Find a free range of len bytes for mmap() in mm, below the
+// thread stacks and above the heap, as high as possible.
+// Caller must hold mm->lock. Returns 0 if there is none.
+static uint64
+vma_gap(struct mm *mm, uint64 len)
+{
+  struct vma *v;
+  uint64 start, end;
+
+  end = TSTACKBASE;
+  for(;;){
+    if(end < len || end - len < PGROUNDUP(mm->sz))
+      return 0;
+    start = end - len;
+    if(len >= MPGSIZE){
+      // so that it can be mapped with megapages.
+      start = MPGROUNDDOWN(start);
+      if(start < PGROUNDUP(mm->sz))
+        return 0;
+    }
+    for(v = mm->vmas; v; v = v->next)
+      if(start < v->end && v->start < end)
+        break;
+    if(v == 0)
+      return start;
+    end = v->start;
+  }
+}
+
+// Map len bytes of ip from offset off, or zeroed memory if
+// ip is 0, at a free range of mm. flags is 0 or VMA_SHARED.
+// A shared anonymous mapping is allocated right away, so that
+// fork() hands the pages themselves to the child.
+// Returns the address, or -1.
+uint64
+vma_mmap(struct mm *mm, uint64 len, int perm, int flags,
+         struct inode *ip, uint off)
+{
+  struct vma *v;
+  uint64 a, start;
+  uint filesz = 0;
+  char *mem;
+
+  vma_reap();
+
+  len = PGROUNDUP(len);
+  if(ip){
+    ilock(ip);
+    if(off < ip->size)
+      filesz = ip->size - off < len ? ip->size - off : len;
+    iunlock(ip);
+  }
+  if(flags & VMA_SHARED)
+    perm |= PTE_SHARED;
+
+  if((v = kmem_cache_alloc(&vmacache)) == 0)
+    return -1;
+  v->perm = perm;
+  v->flags = flags;
+  if(ip && off % PGSIZE == 0)
+    v->flags |= VMA_PCACHE;
+  v->ip = ip ? idup(ip) : 0;
+  v->off = off;
+  v->filesz = filesz;
+
+  acquire(&mm->lock);
+  if((start = vma_gap(mm, len)) == 0)
+    goto bad;
+  v->start = start;
+  v->end = start + len;
+
+  if(ip == 0 && (flags & VMA_SHARED)){
+    for(a = start; a < start + len; a += PGSIZE){
+      if((mem = kalloc_zeroed()) == 0)
+        goto unmap;
+      if(mappages(mm->pagetable, a, PGSIZE, (uint64)mem, perm) != 0){
+        kfree(mem);
+        goto unmap;
+      }
+    }
+  }
+
+  v->next = mm->vmas;
+  mm->vmas = v;
+  release(&mm->lock);
+  return start;
+
+ unmap:
+  uvmunmap(mm->pagetable, start, (a - start) / PGSIZE, 1);
+ bad:
+  release(&mm->lock);
+  v->next = 0;
+  vma_freelist(v);
+  return -1;
+}
+
+// Remove the mappings of va [start, end) in mm, both page
+// aligned, splitting vmas that stick out either side.
+// Returns 0, or -1 if out of memory.
+int
+vma_munmap(struct mm *mm, uint64 start, uint64 end)
+{
+  struct vma *v, **vp, *nv, *dead = 0;
+  uint64 a, b, d;
+
+  vma_reap();
+
+  // in case a vma has to be split in two.
+  if((nv = kmem_cache_alloc(&vmacache)) == 0)
+    return -1;
+
+  acquire(&mm->lock);
+  // megapages that stick out of the range are split first.
+  if((start % MPGSIZE != 0 && uvmsplit(mm->pagetable, start) < 0) ||
+     (end % MPGSIZE != 0 && uvmsplit(mm->pagetable, end - 1) < 0)){
+    release(&mm->lock);
+    kmem_cache_free(&vmacache, nv);
+    return -1;
+  }
+  for(vp = &mm->vmas; (v = *vp) != 0; ){
+    if(v->end <= start || end <= v->start){
+      vp = &v->next;
+      continue;
+    }
+    a = start > v->start ? start : v->start;
+    b = end < v->end ? end : PGROUNDUP(v->end);
+    uvmunmap(mm->pagetable, a, (b - a) / PGSIZE, 1);
+
+    if(v->start < start && end < v->end){
+      // keep both ends; nv takes the upper one.
+      *nv = *v;
+      if(v->ip)
+        nv->ip = idup(v->ip);
+      v->end = start;
+      v = nv;
+      nv = 0;
+      v->next = *vp;
+      *vp = v;
+    } else if(v->start >= start && v->end <= end){
+      *vp = v->next;
+      v->next = dead;
+      dead = v;
+      continue;
+    } else if(v->start < start){
+      v->end = start;
+      vp = &v->next;
+      continue;
+    }
+    // cut off the front.
+    d = end - v->start;
+    v->start = end;
+    v->off += d;
+    v->filesz = v->filesz > d ? v->filesz - d : 0;
+    vp = &v->next;
+  }
+
+  // a fault may still be reading a removed vma's file;
+  // the last one out frees them.
+  if(mm->nfault > 0 && dead){
+    for(v = dead; v->next; v = v->next)
+      ;
+    v->next = mm->dead;
+    mm->dead = dead;
+    dead = 0;
+  }
+  release(&mm->lock);
+
+  tlbshootdown(mm->pagetable);
+  if(nv)
+    kmem_cache_free(&vmacache, nv);
+  vma_freelist(dead);
+  return 0;
+}
+
+// Can ip be read to fill in a page? Not while holding a spin
+// lock, and not from a copyin()/copyout() by readi() or
+// writei(), which hold an inode's lock and perhaps the buffer
+// that would have to be read: on ip itself that would deadlock
+// at once, and on another inode it would lock two inodes in no
+// particular order. fileread() and filewrite() fault such pages
+// in without any inode locked and retry.
+static int
+canread(struct inode *ip)
+{
+  return cansleep() && myproc()->nilock == 0;
+}
+
+// Return page pgno of ip from the page cache, reading it
+// in if it is not there yet, with a kref for the caller.
+// dirty marks the page for pcache_flush(). Any part of the
+// page past the end of the file reads as zero.
+static char *
+pcache_get(struct inode *ip, uint pgno, int dirty)
+{
+  struct pcpage *pg, *new;
+  char *mem;
+  uint n;
+
+  acquire(&pcache.lock);
+  for(pg = ip->pages; pg; pg = pg->next){
+    if(pg->pgno == pgno){
+      krefinc(pg->pa);
+      pg->dirty |= dirty;
+      release(&pcache.lock);
+      return pg->pa;
+    }
+  }
+  release(&pcache.lock);
+
+  if(!canread(ip))
+    return 0;
+  if((mem = kalloc_zeroed()) == 0)
+    return 0;
+  // hold ip's lock until the page is in the cache,
+  // so that a write to ip cannot slip in between.
+  ilock(ip);
+  if(pgno * PGSIZE >= ip->size)
+    goto bad;
+  n = ip->size - pgno * PGSIZE;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if(readi(ip, 0, (uint64)mem, pgno * PGSIZE, n) != n)
+    goto bad;
+  if((new = kmem_cache_alloc(&pcpagecache)) == 0)
+    goto bad;
+
+  acquire(&pcache.lock);
+  for(pg = ip->pages; pg; pg = pg->next){
+    if(pg->pgno == pgno){
+      // another process read it in first.
+      krefinc(pg->pa);
+      pg->dirty |= dirty;
+      release(&pcache.lock);
+      iunlock(ip);
+      kmem_cache_free(&pcpagecache, new);
+      kfree(mem);
+      return pg->pa;
+    }
+  }
+  new->pgno = pgno;
+  new->pa = mem;
+  new->dirty = dirty;
+  new->next = ip->pages;
+  ip->pages = new;
+  krefinc(mem);
+  release(&pcache.lock);
+  iunlock(ip);
+  return mem;
+
+ bad:
+  iunlock(ip);
+  kfree(mem);
+  return 0;
+}
+
+// Write page pgno of ip back to the file, without making the
+// file any longer, a few blocks per transaction as filewrite()
+// does.
+static void
+pcache_write(struct inode *ip, uint pgno, char *pa)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint off = pgno * PGSIZE;
+  uint i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    begin_op();
+    ilock(ip);
+    if(off + i >= ip->size){
+      iunlock(ip);
+      end_op();
+      break;
+    }
+    n = PGSIZE - i;
+    if(n > ip->size - off - i)
+      n = ip->size - off - i;
+    if(n > max)
+      n = max;
+    n = writei(ip, 0, (uint64)pa + i, off + i, n);
+    iunlock(ip);
+    end_op();
+    if(n == 0)
+      break;
+  }
+}
+
+// Write back every cached page of ip that a MAP_SHARED vma
+// may have written. A page stays dirty while it is mapped,
+// since it can still be written.
+static void
+pcache_flush(struct inode *ip)
+{
+  struct pcpage *pg, *next;
+  uint pgno;
+  char *pa;
+
+  // pages in file order, one at a time, as the list can
+  // change while pcache_write() sleeps.
+  pgno = 0;
+  for(;;){
+    acquire(&pcache.lock);
+    next = 0;
+    for(pg = ip->pages; pg; pg = pg->next)
+      if(pg->dirty && pg->pgno >= pgno && (next == 0 || pg->pgno < next->pgno))
+        next = pg;
+    if(next == 0){
+      release(&pcache.lock);
+      break;
+    }
+    pa = next->pa;
+    pgno = next->pgno;
+    if(krefcnt(pa) == 1)
+      next->dirty = 0;
+    krefinc(pa);
+    release(&pcache.lock);
+
+    pcache_write(ip, pgno, pa);
+    kfree(pa);
+    pgno++;
+  }
+}
+
+// Copy the n bytes at src, which writei() has just written
+// to ip at offset off, into the cached page for off, if there
+// is one. The bytes must lie within one page. Caller must hold
+// ip's lock, so that pages are neither added nor dropped.
+void
+pcache_update(struct inode *ip, uint off, char *src, uint n)
+{
+  struct pcpage *pg;
+
+  for(pg = ip->pages; pg; pg = pg->next){
+    // src is the page itself when pcache_write() writes it
+    // back; copying then could undo stores made through a
+    // mapping meanwhile.
+    if(pg->pgno == off / PGSIZE && pg->pa + off % PGSIZE != src){
+      memmove(pg->pa + off % PGSIZE, src, n);
+      break;
+    }
+  }
+}
+
+// Zero the cached pages of ip, which is being truncated, so
+// that those who have them mapped and later mappings go on
+// sharing them. Caller must hold ip's lock.
+void
+pcache_truncate(struct inode *ip)
+{
+  struct pcpage *pg;
+
+  for(pg = ip->pages; pg; pg = pg->next)
+    memset(pg->pa, 0, PGSIZE);
+}
+
+// Forget the cached pages of ip, because its last reference
+// is going away, so nothing has them mapped. Caller must hold
+// itable.lock with ip->ref == 1, so no page can be added.
+void
+pcache_drop(struct inode *ip)
+{
+  struct pcpage *pg, *next;
+
+  if(ip->pages == 0)
+    return;
+
+  acquire(&pcache.lock);
+  pg = ip->pages;
+  ip->pages = 0;
+  release(&pcache.lock);
+
+  for(; pg; pg = next){
+    next = pg->next;
+    kfree(pg->pa);
+    kmem_cache_free(&pcpagecache, pg);
+  }
+}
+
+// Keep ip's cached pages for the next exec() of it, by holding
+// a reference to ip until NPCHOLD other files have been exec'd.
+// Must be called inside a transaction, for the iput().
+void
+pcache_hold(struct inode *ip)
+{
+  struct inode *old;
+  int i;
+
+  ip = idup(ip);
+  acquire(&pcache.lock);
+  for(i = 0; i < NPCHOLD - 1; i++)
+    if(pcache.hold[i] == ip)
+      break;
+  old = pcache.hold[i];
+  for(; i > 0; i--)
+    pcache.hold[i] = pcache.hold[i - 1];
+  pcache.hold[0] = ip;
+  release(&pcache.lock);
+
+  // drops the oldest, or the extra reference if ip
+  // was already held.
+  if(old)
+    iput(old);
+}
+
+// Stop holding ip for exec(), because it has been unlinked, so
+// that its blocks are freed as soon as nobody else uses it.
+// Must be called inside a transaction, for the iput().
+void
+pcache_unhold(struct inode *ip)
+{
+  int i, found = 0;
+
+  acquire(&pcache.lock);
+  for(i = 0; i < NPCHOLD; i++){
+    if(pcache.hold[i] == ip)
+      found = 1;
+    if(found)
+      pcache.hold[i] = i + 1 < NPCHOLD ? pcache.hold[i + 1] : 0;
+  }
+  release(&pcache.lock);
+
+  if(found)
+    iput(ip);
+}
+
+// Find or make the page at offset pos of vma v, and the
+// permissions to map it with.
+static char *
+vma_page(struct vma *v, uint64 pos, int *perm)
+{
+  char *mem;
+  int shared = (v->flags & VMA_SHARED) != 0;
+  uint n;
+
+  *perm = v->perm;
+  if((v->perm & (PTE_R|PTE_W|PTE_X)) == 0)
+    return 0; // PROT_NONE
+
+  if(v->ip == 0 || pos >= v->filesz){
+    // anonymous memory, or bss.
+    if(v->ip && shared)
+      return 0; // past the end of the file
+    return kalloc_zeroed();
+  }
+
+  if((v->flags & VMA_PCACHE) && (shared || pos + PGSIZE <= v->filesz)){
+    if((mem = pcache_get(v->ip, (v->off + pos) / PGSIZE,
+                         shared && (v->perm & PTE_W))) == 0)
+      return 0;
+    if(!shared && (v->perm & PTE_W))
+      *perm = (v->perm & ~PTE_W) | PTE_COW;
+    return mem;
+  }
+
+  if(!canread(v->ip))
+    return 0;
+  if((mem = kalloc_zeroed()) == 0)
+    return 0;
+  n = v->filesz - pos;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  ilock(v->ip);
+  if(readi(v->ip, 0, (uint64)mem, v->off + pos, n) != n){
+    iunlock(v->ip);
+    kfree(mem);
+    return 0;
+  }
+  iunlock(v->ip);
+  return mem;
+}
+
+// Fill in the page at va, which is in vma v of mm (the current
+// process's) and not mapped. Called with mm->lock held, which
+// it releases, since reading the file may sleep; v cannot be
+// freed meanwhile, only removed from mm by munmap().
+// Returns 0 if the access can now be retried, -1 if not.
+int
+vma_fault(struct mm *mm, struct vma *v, uint64 va)
+{
+  struct vma vc, *dead = 0;
+  uint64 a;
+  char *mem;
+  int perm, r, mega;
+
+  va = PGROUNDDOWN(va);
+
+  // a whole megapage of a large anonymous mapping at once.
+  a = MPGROUNDDOWN(va);
+  mega = v->ip == 0 && (v->flags & VMA_SHARED) == 0 &&
+         (v->perm & (PTE_R|PTE_W|PTE_X)) &&
+         a >= v->start && a + MPGSIZE <= v->end &&
+         uvmcanmega(mm->pagetable, a);
+
+  vc = *v;
+  mm->nfault++;
+  release(&mm->lock);
+
+  mem = 0;
+  if(mega && (mem = uvmallocmega()) == 0)
+    mega = 0;
+  if(!mega)
+    mem = vma_page(&vc, va - vc.start, &perm);
+
+  acquire(&mm->lock);
+  if(mem == 0){
+    r = -1;
+  } else if(vma_find(mm, va) != v || uvmmapped(mm->pagetable, va)){
+    // unmapped by munmap(), or another thread faulted it
+    // in while we were reading; try again.
+    r = 0;
+    if(mega)
+      kfree_order(mem, MPGORDER);
+    else
+      kfree(mem);
+  } else if(mega){
+    // if some other page of the range got mapped meanwhile,
+    // the retry takes a single page.
+    r = 0;
+    if(uvmmapmega(mm->pagetable, a, mem, vc.perm) != 0)
+      kfree_order(mem, MPGORDER);
+  } else if(mappages(mm->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    r = -1;
+    kfree(mem);
+  } else {
+    r = 0;
+  }
+  if(--mm->nfault == 0){
+    dead = mm->dead;
+    mm->dead = 0;
+  }
+  release(&mm->lock);
+
+  vma_park(dead);
+  return r;
+}
@@ -0,0 +1,18 @@
+// A range of user virtual memory backed by a file, filled in
+// one page at a time by vma_fault() on first touch.
+struct vma {
+  uint64 start;        // First virtual address, page aligned
+  uint64 end;          // One past the last virtual address
+  int perm;            // PTE_R|PTE_W|PTE_X|PTE_U for its pages
+  int flags;           // VMA_PCACHE, VMA_SHARED
+  struct inode *ip;    // File the pages come from, or 0
+  uint off;            // Offset in ip of start
+  uint filesz;         // Bytes from ip; the rest reads as zero
+  struct vma *next;    // Next vma of the same mm
+};
+
+// Pages of this vma that lie in the file come from the page
+// cache, shared with every other process mapping the file.
+#define VMA_PCACHE 0x1
+// MAP_SHARED: writes go to the page cache, and the file.
+#define VMA_SHARED 0x2
@@ -66,7 +66,7 @@ go(int which_child)
     iters++;
     if((iters % 500) == 0)
       write(1, which_child?"B":"A", 1);
-    int what = rand() % 23;
+    int what = rand() % 24;
     if(what == 1){
       close(open("grindir/../a", O_CREATE|O_RDWR));
     } else if(what == 2){
@@ -289,6 +289,47 @@ go(int which_child)
         printf("grind: exec pipeline failed %d %d \"%s\"\n", st1, st2, buf);
         exit(1);
       }
+    } else if(what == 23){
+      // echo hi | cat, with spawn()
+      int aa[2], bb[2], map[NOFILE];
+      if(pipe(aa) < 0){
+        fprintf(2, "grind: pipe failed\n");
+        exit(1);
+      }
+      if(pipe(bb) < 0){
+        fprintf(2, "grind: pipe failed\n");
+        exit(1);
+      }
+      for(int i = 0; i < NOFILE; i++)
+        map[i] = i < 3 ? i : -1;
+      map[1] = aa[1];
+      char *args1[3] = { "echo", "hi", 0 };
+      if(spawn("grindir/../echo", args1, map) < 0){
+        fprintf(2, "grind: spawn echo failed\n");
+        exit(1);
+      }
+      map[0] = aa[0];
+      map[1] = bb[1];
+      char *args2[2] = { "cat", 0 };
+      if(spawn("/cat", args2, map) < 0){
+        fprintf(2, "grind: spawn cat failed\n");
+        exit(1);
+      }
+      close(aa[0]);
+      close(aa[1]);
+      close(bb[1]);
+      char buf[4] = { 0, 0, 0, 0 };
+      read(bb[0], buf+0, 1);
+      read(bb[0], buf+1, 1);
+      read(bb[0], buf+2, 1);
+      close(bb[0]);
+      int st1, st2;
+      wait(&st1);
+      wait(&st2);
+      if(st1 != 0 || st2 != 0 || strcmp(buf, "hi\n") != 0){
+        printf("grind: spawn pipeline failed %d %d \"%s\"\n", st1, st2, buf);
+        exit(1);
+      }
     }
   }
 }
@@ -0,0 +1,59 @@
+// Read throughput of files front to back, in the 512-byte reads
+// cat uses. Run it soon after boot, on files nothing has read
+// since, e.g. "readbench usertests grind", so that the blocks
+// come from the disk and readahead in readi() matters.
+//
+// usage: readbench file ...
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define HZ 10000000  // rate of the time CSR in qemu
+
+char buf[512];
+
+static uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, fd, n;
+  uint64 start, t, bytes, total = 0, totalt = 0;
+
+  if(argc < 2){
+    fprintf(2, "usage: readbench file ...\n");
+    exit(1);
+  }
+
+  for(i = 1; i < argc; i++){
+    if((fd = open(argv[i], 0)) < 0){
+      fprintf(2, "readbench: cannot open %s\n", argv[i]);
+      exit(1);
+    }
+    bytes = 0;
+    start = rdtime();
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+      bytes += n;
+    t = rdtime() - start;
+    close(fd);
+    if(t == 0)
+      t = 1;
+    printf("readbench: %s: %d KB in %d us, %d KB/s\n", argv[i],
+           (int)(bytes / 1024), (int)(t / (HZ / 1000000)),
+           (int)(bytes * HZ / 1024 / t));
+    total += bytes;
+    totalt += t;
+  }
+  if(argc > 2)
+    printf("readbench: total %d KB in %d us, %d KB/s\n",
+           (int)(total / 1024), (int)(totalt / (HZ / 1000000)),
+           (int)(total * HZ / 1024 / totalt));
+  exit(0);
+}
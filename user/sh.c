@@ -1,6 +1,7 @@
 // Shell.
 
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
 
@@ -52,13 +53,15 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
+int spawncmd(struct cmd*, int*);
 void runcmd(struct cmd*) __attribute__((noreturn));
 
 // Execute cmd.  Never returns.
 void
 runcmd(struct cmd *cmd)
 {
-  int p[2];
+  int p[2], i, map[NOFILE];
   struct backcmd *bcmd;
   struct execcmd *ecmd;
   struct listcmd *lcmd;
@@ -92,7 +95,7 @@ runcmd(struct cmd *cmd)
 
   case LIST:
     lcmd = (struct listcmd*)cmd;
-    if(fork1() == 0)
+    if(spawncmd(lcmd->left, 0) == 0 && fork1() == 0)
       runcmd(lcmd->left);
     wait(0);
     runcmd(lcmd->right);
@@ -102,14 +105,20 @@ runcmd(struct cmd *cmd)
     pcmd = (struct pipecmd*)cmd;
     if(pipe(p) < 0)
       panic("pipe");
-    if(fork1() == 0){
+    for(i = 0; i < NOFILE; i++)
+      map[i] = i;
+    map[p[0]] = map[p[1]] = -1;
+    map[1] = p[1];
+    if(spawncmd(pcmd->left, map) == 0 && fork1() == 0){
       close(1);
       dup(p[1]);
       close(p[0]);
       close(p[1]);
       runcmd(pcmd->left);
     }
-    if(fork1() == 0){
+    map[1] = 1;
+    map[0] = p[0];
+    if(spawncmd(pcmd->right, map) == 0 && fork1() == 0){
       close(0);
       dup(p[0]);
       close(p[0]);
@@ -124,13 +133,63 @@ runcmd(struct cmd *cmd)
 
   case BACK:
     bcmd = (struct backcmd*)cmd;
-    if(fork1() == 0)
+    if(spawncmd(bcmd->cmd, 0) == 0 && fork1() == 0)
       runcmd(bcmd->cmd);
     break;
   }
   exit(0);
 }
 
+// Start cmd with spawn() if it is just a program and some
+// redirections, rather than copy the shell with fork1() only for
+// exec() to throw the copy away. The child's descriptor i starts
+// out as our map[i], or i with no map, before redirections.
+// Returns the child's pid, 0 if cmd needs fork1() and runcmd(),
+// or -1 if it failed to start.
+int
+spawncmd(struct cmd *cmd, int *map)
+{
+  int fdmap[NOFILE], opened[NOFILE];
+  int i, n, fd, pid;
+  struct cmd *c;
+  struct execcmd *ecmd;
+  struct redircmd *rcmd;
+
+  for(c = cmd; c && c->type == REDIR; c = ((struct redircmd*)c)->cmd)
+    ;
+  if(c == 0 || c->type != EXEC || ((struct execcmd*)c)->argv[0] == 0)
+    return 0;
+  ecmd = (struct execcmd*)c;
+
+  for(i = 0; i < NOFILE; i++)
+    fdmap[i] = map ? map[i] : i;
+
+  // Open the files the way runcmd() would, outermost first,
+  // so an inner redirection of the same descriptor wins.
+  pid = -1;
+  n = 0;
+  for(c = cmd; c->type == REDIR; c = rcmd->cmd){
+    rcmd = (struct redircmd*)c;
+    if(n == NOFILE || (fd = open(rcmd->file, rcmd->mode)) < 0){
+      fprintf(2, "open %s failed\n", rcmd->file);
+      goto out;
+    }
+    opened[n++] = fd;
+    for(i = 0; i < NOFILE; i++)
+      if(fdmap[i] == fd)
+        fdmap[i] = -1;
+    fdmap[rcmd->fd] = fd;
+  }
+
+  if((pid = spawn(ecmd->argv[0], ecmd->argv, fdmap)) < 0)
+    fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+
+out:
+  while(n > 0)
+    close(opened[--n]);
+  return pid;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -146,7 +205,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  struct cmd *cmd;
+  int fd, pid;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -165,9 +225,13 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait(0);
+    if((cmd = parsecmd(buf)) == 0)
+      continue;
+    if((pid = spawncmd(cmd, 0)) == 0 && fork1() == 0)
+      runcmd(cmd);
+    if(pid >= 0)
+      wait(0);
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -261,6 +325,7 @@ backcmd(struct cmd *subcmd)
 // Parsing
 
 char whitespace[] = " \t\r\n\v";
+int parseerr;
 char symbols[] = "<|>&;()";
 
 int
@@ -325,18 +390,33 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// The shell parses in its own process now, so a syntax error
+// is reported and the line dropped rather than panic().
+void
+syntax(char *msg)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", msg);
+  parseerr = 1;
+}
+
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -380,8 +460,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -406,8 +488,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -432,13 +516,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
+    if(argc >= MAXARGS){
+      syntax("too many args");
+      return ret;
+    }
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -492,3 +580,31 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+void
+freecmd(struct cmd *cmd)
+{
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    freecmd(((struct redircmd*)cmd)->cmd);
+    break;
+
+  case PIPE:
+    freecmd(((struct pipecmd*)cmd)->left);
+    freecmd(((struct pipecmd*)cmd)->right);
+    break;
+
+  case LIST:
+    freecmd(((struct listcmd*)cmd)->left);
+    freecmd(((struct listcmd*)cmd)->right);
+    break;
+
+  case BACK:
+    freecmd(((struct backcmd*)cmd)->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -0,0 +1,77 @@
+// Process creation rate: fork() then exec() against spawn(),
+// each starting a copy of this program that exits at once.
+// Measured with a small heap and again after growing and
+// touching a larger one, since fork() copies the parent's page
+// tables and spawn() does not look at them.
+//
+// usage: spawnbench [n [megabytes]]
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+int
+forkexec(char *path, char **argv)
+{
+  int pid;
+
+  pid = fork();
+  if(pid == 0){
+    exec(path, argv);
+    exit(1);
+  }
+  return pid;
+}
+
+// Ticks to start and reap n children.
+int
+run(int usespawn, int n, char *path)
+{
+  char *argv[] = { path, "-x", 0 };
+  int i, start, xstatus;
+
+  start = uptime();
+  for(i = 0; i < n; i++){
+    if((usespawn ? spawn(path, argv, 0) : forkexec(path, argv)) < 0){
+      printf("spawnbench: %s failed\n", usespawn ? "spawn" : "fork");
+      exit(1);
+    }
+    if(wait(&xstatus) < 0 || xstatus != 0){
+      printf("spawnbench: child failed\n");
+      exit(1);
+    }
+  }
+  return uptime() - start;
+}
+
+void
+report(int n, char *heap, char *path)
+{
+  printf("spawnbench: %d children, %s heap: fork+exec %d ticks, spawn %d ticks\n",
+         n, heap, run(0, n, path), run(1, n, path));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, mb;
+  char *p;
+
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit(0);
+
+  n = argc > 1 ? atoi(argv[1]) : 200;
+  mb = argc > 2 ? atoi(argv[2]) : 8;
+
+  report(n, "small", argv[0]);
+
+  p = sbrk(mb * 1024 * 1024);
+  if(p == (char*)-1){
+    printf("spawnbench: sbrk failed\n");
+    exit(1);
+  }
+  for(i = 0; i < mb * 1024 * 1024; i += 4096)
+    p[i] = 1;
+  report(n, "large", argv[0]);
+
+  exit(0);
+}
@@ -341,6 +341,101 @@ int test7(int repeat) {
 }
 
 
+
+// Test #8 thread function
+volatile int word    = 0;
+volatile int arrived = 0;
+
+void* test8_func(void *arg) {
+  __sync_fetch_and_add(&arrived, 1);
+  // Park until the main thread changes the word.
+  while(word == 0) { futex_wait((int*)&word, 0); }
+  thread_exit((void*)(uint64)word);
+}
+
+// This test parks threads in futex_wait() and wakes them with futex_wake()
+// after changing the word, and checks that every thread wakes up and sees
+// the new value. futex_wait() on a word that no longer holds the expected
+// value must return at once instead of sleeping.
+int test8(int repeat) {
+  printf("Test #8: futex wait and wake                             ");
+
+  int i = 0, sum = 0, passed = 0, woken = 0;
+  void *ret = 0;
+
+  while(repeat--) {
+    memset(thread, 0, max_threads * sizeof(thread_t));
+    word = 0; arrived = 0; sum = 0;
+
+    for(i = 0; i < num_threads; i++) {
+      if(thread_create(&thread[i], &test8_func, 0)) { panic("thread_create failed"); }
+    }
+    // Give the threads a chance to park before the word changes.
+    while(arrived < num_threads) { sleep(1); }
+    sleep(1);
+    word = 1;
+    woken = futex_wake((int*)&word, num_threads);
+    for(i = 0; i < num_threads; i++) {
+      if(thread_join(thread[i], &ret)) { panic("thread_join failed"); }
+      sum += ((uint64)ret == 1);
+    }
+
+    // Every thread saw the new word, no more threads were woken than were
+    // created, nobody is left waiting, and a stale value does not sleep.
+    if(!(passed = (sum == num_threads && woken >= 0 && woken <= num_threads &&
+                   futex_wake((int*)&word, num_threads) == 0 &&
+                   futex_wait((int*)&word, 0) == -1))) { break; }
+  }
+  printf("(%s)\n", passed ? "pass" : "fail");
+
+  return passed;
+}
+
+
+// Test #9 thread function
+#define test9_iters 1000
+volatile int counter = 0;
+
+void* test9_func(void *arg) {
+  int i, c;
+  // A short critical section taken many times, so that threads keep
+  // finding the mutex held and park on it.
+  for(i = 0; i < test9_iters; i++) {
+    thread_mutex_lock(&mutex);
+    c = counter;
+    counter = c + 1;
+    thread_mutex_unlock(&mutex);
+  }
+  thread_exit(0);
+}
+
+// This test has many threads increment a shared counter under the mutex.
+// A lost update means two threads were in the critical section at once, and
+// a thread that is never woken from futex_wait() hangs the test.
+int test9(int repeat) {
+  printf("Test #9: contended mutex on a shared counter             ");
+
+  int i = 0, passed = 0;
+
+  while(repeat--) {
+    memset(thread, 0, max_threads * sizeof(thread_t));
+    counter = 0;
+
+    for(i = 0; i < num_threads; i++) {
+      if(thread_create(&thread[i], &test9_func, 0)) { panic("thread_create failed"); }
+    }
+    for(i = 0; i < num_threads; i++) {
+      if(thread_join(thread[i], 0)) { panic("thread_join failed"); }
+    }
+
+    // Every increment must have been kept.
+    if(!(passed = (counter == num_threads * test9_iters))) { break; }
+  }
+  printf("(%s)\n", passed ? "pass" : "fail");
+
+  return passed;
+}
+
 int main(int argc, char **argv) {
   // User-specified test#
   int test_vec = 0;
@@ -350,7 +445,7 @@ int main(int argc, char **argv) {
     }
   }
   // Test all, if no test# is specified.
-  test_vec = (test_vec == 0 ? 0xfe : test_vec);
+  test_vec = (test_vec == 0 ? 0x3fe : test_vec);
 
   int repeat, passed;
   thread_mutex_init(&mutex);
@@ -369,6 +464,8 @@ int main(int argc, char **argv) {
   if((test_vec = test_vec >> 1) & 0x1) { passed &= test5(repeat);   }
   if((test_vec = test_vec >> 1) & 0x1) { passed &= test6(repeat);   }
   if((test_vec = test_vec >> 1) & 0x1) { passed &= test7(repeat/5); } // Test 5x less.
+  if((test_vec = test_vec >> 1) & 0x1) { passed &= test8(repeat/5); } // Test 5x less.
+  if((test_vec = test_vec >> 1) & 0x1) { passed &= test9(repeat/5); } // Test 5x less.
   printf("%s\n", passed ? "ALL TESTS PASSED" : "SOME TESTS FAILED");
 
   free(thread); free(tid);
@@ -53,8 +53,18 @@ int twait(thread_t, void **);
 
 int texit(void *);
 
+int futex_wait(int *, int);
+
+int futex_wake(int *, int);
+
 ///////////////////////////////////
 
+void *mmap(void *, uint, int, int, int, uint);
+
+int munmap(void *, uint);
+
+int spawn(const char *, char **, int *);
+
 // ulib.c
 int stat(const char *, struct stat *);
 
@@ -2571,6 +2571,291 @@ badarg(char *s)
   exit(0);
 }
 
+// a heap large enough for megapages, shrunk to part of one,
+// and shared copy-on-write with a child.
+void
+sbrkmega(char *s)
+{
+  enum { BIG = 6*1024*1024 };
+  char *a;
+  int i, pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG; i += 4096)
+    a[i] = i / 4096;
+
+  // cut into the middle of the last megapage.
+  if(sbrk(-(1024*1024 + 4096)) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG - (1024*1024 + 4096); i += 4096){
+    if(a[i] != (char)(i / 4096)){
+      printf("%s: lost data at %d\n", s, i);
+      exit(1);
+    }
+  }
+
+  pid = fork();
+  if(pid == 0){
+    for(i = 0; i < 4*1024*1024; i += 4096){
+      if(a[i] != (char)(i / 4096))
+        exit(1);
+      a[i] = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4*1024*1024; i += 4096){
+    if(a[i] != (char)(i / 4096)){
+      printf("%s: child write reached parent\n", s);
+      exit(1);
+    }
+  }
+  // the child is gone, so these writes need no copies.
+  for(i = 0; i < 4*1024*1024; i += 4096)
+    a[i] = 1;
+  for(i = 0; i < 4*1024*1024; i += 4096){
+    if(a[i] != 1){
+      printf("%s: parent write lost\n", s);
+      exit(1);
+    }
+  }
+}
+
+// mmap() of a file, private and shared, and of anonymous memory.
+void
+mmaptest(char *s)
+{
+  enum { N = 2*4096 + 100 };
+  static char buf[N];
+  char *p;
+  int fd, i, pid, xstatus;
+
+  for(i = 0; i < N; i++)
+    buf[i] = 'a' + i % 23;
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+
+  // private: reads the file, writes stay in this process.
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  if(memcmp(p, buf, N) != 0 || p[N] != 0){
+    printf("%s: mmap private wrong contents\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  if(munmap(p, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // shared: writes reach the file after munmap.
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'a'){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  p[1] = 'Y';
+  p[N-1] = 'Z';
+  // write() goes to the mapped page too, and keeps the stores.
+  if((i = open("mmapfile", O_RDWR)) < 0 || write(i, "W", 1) != 1){
+    printf("%s: write to mapped file failed\n", s);
+    exit(1);
+  }
+  close(i);
+  if(p[0] != 'W'){
+    printf("%s: write() not seen through shared mapping\n", s);
+    exit(1);
+  }
+  munmap(p, N);
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, N) != N || buf[0] != 'W' || buf[1] != 'Y' || buf[N-1] != 'Z'){
+    printf("%s: shared write did not reach the file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  // private memory is copied to the child.
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  p[0] = 'P';
+  pid = fork();
+  if(pid == 0){
+    if(p[0] != 'P')
+      exit(1);
+    p[0] = 'Q';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[0] != 'P'){
+    printf("%s: private memory not copied to the child\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+
+  // shared anonymous memory is shared with the child.
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED || p[0] != 0){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid == 0){
+    p[0] = 'C';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[0] != 'C'){
+    printf("%s: child write to shared memory lost\n", s);
+    exit(1);
+  }
+
+  // unmapped memory faults.
+  munmap(p, 4096);
+  pid = fork();
+  if(pid == 0){
+    p[0] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: write to unmapped memory did not fault\n", s);
+    exit(1);
+  }
+}
+
+// read() of one file into a mapping of another, by two processes
+// going opposite ways at once, must not lock the two files in
+// opposite orders.
+void
+mmapcross(char *s)
+{
+  enum { N = 100 };
+  char *names[2] = { "mmapx", "mmapy" };
+  char buf[N], *p;
+  int fd, fd2, i, j, k, xstatus;
+
+  for(i = 0; i < 2; i++){
+    memset(buf, 'x' + i, N);
+    fd = open(names[i], O_CREATE|O_RDWR);
+    if(fd < 0 || write(fd, buf, N) != N){
+      printf("%s: create %s failed\n", s, names[i]);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  for(i = 0; i < 2; i++){
+    if(fork() == 0){
+      // N is less than a page, so each fault reads the
+      // file rather than finding the page cached.
+      if((fd = open(names[1-i], O_RDONLY)) < 0)
+        exit(1);
+      for(j = 0; j < 200; j++){
+        p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED || (fd2 = open(names[i], O_RDONLY)) < 0)
+          exit(1);
+        if(read(fd2, p, N) != N)
+          exit(1);
+        for(k = 0; k < N; k++)
+          if(p[k] != 'x' + i)
+            exit(1);
+        close(fd2);
+        munmap(p, N);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < 2; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: read into a mapping of the other file failed\n", s);
+      exit(1);
+    }
+  }
+  unlink("mmapx");
+  unlink("mmapy");
+}
+
+// spawn() with a descriptor map, and its failures.
+void
+spawntest(char *s)
+{
+  char *echoargv[] = { "echo", "OK", 0 };
+  char buf[4];
+  int fds[2], map[NOFILE], i, pid, xstatus;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NOFILE; i++)
+    map[i] = -1;
+  map[1] = fds[1];
+  map[2] = 2;
+  pid = spawn("echo", echoargv, map);
+  if(pid < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  // echo writes "OK" and "\n" separately, so read to EOF.
+  memset(buf, 0, sizeof(buf));
+  for(i = 0; i < sizeof(buf) - 1 && read(fds[0], buf + i, 1) == 1; i++)
+    ;
+  if(strcmp(buf, "OK\n") != 0){
+    printf("%s: wrong output \"%s\"\n", s, buf);
+    exit(1);
+  }
+  if(read(fds[0], buf, 1) != 0){
+    printf("%s: child kept the pipe open\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+
+  if(spawn("nonexistent", echoargv, 0) >= 0){
+    printf("%s: spawn of a missing file succeeded\n", s);
+    exit(1);
+  }
+  map[1] = NOFILE;
+  if(spawn("echo", echoargv, map) >= 0){
+    printf("%s: spawn with a bad descriptor map succeeded\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: failed spawn left a child\n", s);
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2635,6 +2920,10 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {mmaptest, "mmaptest" },
+  {mmapcross, "mmapcross" },
+  {sbrkmega, "sbrkmega" },
+  {spawntest, "spawntest" },
 
   { 0, 0},
 };
@@ -40,4 +40,10 @@ entry("uptime");
 # Assignment 6 : Thread
 entry("tfork");
 entry("twait");
-entry("texit");
\ No newline at end of file
+entry("texit");
+entry("futex_wait");
+entry("futex_wake");
+
+entry("mmap");
+entry("munmap");
+entry("spawn");
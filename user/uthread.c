@@ -6,18 +6,27 @@
 int thread_create(thread_t *t, void *(*func)(void *), void *arg) {
 
 	int tid = tfork(func, arg);
+	if (tid < 0)
+		return -1;
 	*t = tid;
-	return !tid;
+	return 0;
 }
 
 int thread_join(thread_t t, void **ret) {
-	return -1;
+	return twait(t, ret);
 }
 
 void thread_exit(void *ret) {
-	exit(1);
+	texit(ret);
+	exit(0); // not reached
 }
 
+// mtx->locked is 0 when unlocked, 1 when locked, and 2 when locked
+// and other threads may be parked in futex_wait() on it.
+
+// Attempts to take a contended lock before parking in the kernel.
+#define MUTEX_SPIN 100
+
 void thread_mutex_init(thread_mutex_t *mtx) {
 	mtx->locked = 0;
 
@@ -28,8 +37,26 @@ void thread_mutex_destroy(thread_mutex_t *mtx) {
 }
 
 void thread_mutex_lock(thread_mutex_t *mtx) {
+	int c;
+
+	// The holder usually releases soon, so spin a little
+	// before paying for a trip into the kernel.
+	for (int i = 0; i < MUTEX_SPIN; i++) {
+		if ((c = __sync_val_compare_and_swap(&mtx->locked, 0, 1)) == 0)
+			return;
+		if (c == 2)
+			break; // others are already parked; join them
+	}
+
+	// Mark the lock contended and park until the holder wakes us.
+	while (__sync_lock_test_and_set(&mtx->locked, 2) != 0)
+		futex_wait(&mtx->locked, 2);
 }
 
 void thread_mutex_unlock(thread_mutex_t *mtx) {
-	mtx->locked = 0;
+	// Only a contended lock needs a wakeup.
+	if (__sync_fetch_and_sub(&mtx->locked, 1) != 1) {
+		__sync_lock_release(&mtx->locked);
+		futex_wake(&mtx->locked, 1);
+	}
 }